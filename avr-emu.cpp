@@ -0,0 +1,1420 @@
+/*
+ * @file avr-emu.cpp
+ *
+ * Emulator of the Linkstation AVR, to run avr-evtd without the hardware
+ *
+ * Copyright © 2008-2015 Rogério Theodoro de Brito <rbrito@ime.usp.br>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DAEMON_LOCATION		"./avr-evtd"
+#define EVENTS_VARIABLE		"AVR_EMU_EVENTS"	/* FIFO the event script writes to */
+const int CMD_REPEAT = 4;		/* Each command comes this many times */
+const int WAKE_BITS = 12;		/* Bits of the wake-up time */
+const int WAKE_BIT_BASE = ' ';		/* Plus 2 * bit + value */
+const int DEFAULT_WITHIN = 2000;	/* Milliseconds an expectation waits */
+const int DEFAULT_PRESS = 100;		/* Milliseconds a button is held down */
+const int IDLE_GAP = 20;		/* Milliseconds of silence ending a command */
+const int STOP_GRACE = 3000;		/* Milliseconds the daemon has to exit */
+const size_t RX_SIZE = 4096;		/* Command bytes awaiting expectations */
+const size_t PENDING_SIZE = 64;		/* Bytes of a command being decoded */
+const size_t MAX_EVENTS = 64;		/* Events awaiting expectations */
+const int MAX_WORDS = 64;		/* Words on a scenario line */
+const int MAX_DEPTH = 8;		/* Nesting of repeat blocks */
+
+typedef long long usec_t;
+
+/* Commands the daemon sends, as they are on the wire once de-repeated */
+struct avr_command {
+	const char *name;
+	const char *wire;
+};
+
+/* Messages the AVR sends */
+struct avr_message {
+	const char *name;
+	char raw;
+};
+
+struct avr_button {
+	const char *name;
+	char push;
+	char release;
+};
+
+enum token_kind {
+	TOKEN_WAKE = -1,	/* The twelve bits of a wake-up time */
+	TOKEN_UNKNOWN = -2	/* A byte no command starts with */
+};
+
+/* A command picked out of the byte stream */
+struct token {
+	int kind;		/* Index in commands[], or a token_kind */
+	long value;		/* Wake-up time, or the unknown byte */
+	size_t length;		/* Bytes taken */
+};
+
+/* What the daemon has told the emulated AVR */
+struct avr_state {
+	int run_byte;		/* Byte being repeated, -1 if none */
+	int run_length;
+	usec_t last_rx;		/* When the last byte came */
+	unsigned char pending[PENDING_SIZE];	/* Not yet a whole command */
+	size_t npending;
+	const char *power_led;
+	const char *disk_led;
+	long wake;		/* Wake-up time programmed, -1 if off */
+	long next_wake;		/* Bits of a timer sequence in progress */
+	bool watchdog;		/* Armed by a keep-alive */
+	usec_t kicked;
+	unsigned long commands;
+};
+
+/* Command bytes not matched by an expectation yet */
+struct rx_buffer {
+	unsigned char data[RX_SIZE];
+	usec_t at[RX_SIZE];
+	size_t length;
+};
+
+struct emu_event {
+	char name;
+	int arg;
+	usec_t at;
+};
+
+/* A sequence of command bytes to be matched */
+struct pattern {
+	unsigned char want[RX_SIZE];
+	bool any_bit[RX_SIZE];	/* Either value of a wake-up bit will do */
+	size_t length;
+};
+
+struct directive {
+	const char *name;
+	int min_args;
+	int max_args;
+	void (*run)(char **args, int nargs);
+};
+
+static const avr_command commands[] = {
+	{ "init",		"AFJ>" },
+	{ "timer-off",		">" },
+	{ "timer-begin",	"><:8" },
+	{ "timer-end",		"?" },
+	{ "pulse",		"[" },
+	{ "steady",		"Z" },
+	{ "watchdog-off",	"K" },
+	{ "disk-off",		"V" },
+	{ "disk-on",		"W" },
+	{ "disk-flash",		"Y" },
+	{ "disk-flash-off",	"X" },
+	{ "fan-slow",		"\\" },
+};
+const int NCOMMANDS = sizeof(commands) / sizeof(commands[0]);
+
+static const avr_message messages[] = {
+	{ "fan-high",	'$' },
+	{ "fan-fault",	'%' },
+	{ "ack",	'0' },
+	{ "halt",	'1' },
+	{ "ready",	'3' },
+};
+const int NMESSAGES = sizeof(messages) / sizeof(messages[0]);
+
+static const avr_button buttons[] = {
+	{ "power",	'!',	' ' },
+	{ "reset",	'#',	'"' },
+};
+const int NBUTTONS = sizeof(buttons) / sizeof(buttons[0]);
+
+static const char *daemon_path = DAEMON_LOCATION;
+static const char *scenario_name;
+static char **lines;
+static int nlines;
+static int lineno;		/* Line of the directive being run */
+static bool verbose = false;
+static char **daemon_args;	/* Passed on after our own */
+static int ndaemon_args;
+
+static char work_dir[] = "/tmp/avr-emu.XXXXXX";
+static char config_path[PATH_MAX];
+static char events_path[PATH_MAX];
+static int master = -1;		/* Our side of the pseudo-terminal */
+static int slave = -1;		/* Held open so that reads never see EOF */
+static int events_fd = -1;
+static int events_writer = -1;	/* Keeps the FIFO from reporting EOF */
+static char event_line[128];	/* Partial line read from the FIFO */
+static size_t event_line_length;
+static pid_t daemon_pid = -1;
+static int daemon_status;
+static usec_t started;
+
+static avr_state avr = { -1, 0, 0, { 0 }, 0, "unknown", "unknown", -1, 0, false, 0, 0 };
+static rx_buffer rx;
+static emu_event events[MAX_EVENTS];
+static size_t nevents;
+static bool ignored[256];
+static pattern expected;
+static emu_event wanted_event;	/* Argument -1 for any */
+static size_t wanted_index;	/* Where it was found */
+static usec_t watchdog_limit;	/* Zero if not checked */
+
+/* Reply latency, from the last message sent to the first reply */
+static usec_t input_at;
+static bool input_pending = false;
+static usec_t latency_min, latency_max, latency_sum;
+static unsigned long replies;
+static unsigned long checks;
+
+/* Function declarations */
+static void usage(void) __attribute__ ((noreturn));
+static int event_script(int argc, char *argv[]);
+static usec_t now_usec(void);
+static void fail(const char *format, ...) __attribute__ ((format(printf, 1, 2), noreturn));
+static void note(const char *format, ...) __attribute__ ((format(printf, 1, 2)));
+static void cleanup(void);
+static void read_scenario(const char *name);
+static int split_words(char *line, char **words);
+static void setup_work_dir(void);
+static void write_config(int first, int last);
+static void start_daemon(void);
+static void pump(usec_t until, bool (*done)(void));
+static void feed_byte(unsigned char byte, usec_t at);
+static void end_run(bool idle);
+static void decode_pending(bool final);
+static bool next_token(const unsigned char *data, size_t length, bool final, token *t);
+static void describe(const unsigned char *data, size_t length, char *buff, size_t size);
+static void apply_token(const token *t);
+static void read_events(void);
+static void reap_daemon(void);
+static void send_raw(const char *data, size_t length, const char *what);
+static void record_reply(usec_t at);
+static long parse_number(const char *word);
+static int find_button(const char *name);
+static int find_command(const char *name);
+static bool is_end(const char *line);
+static void run_scenario(void);
+
+
+/**
+ * Print usage of the program and terminate execution.
+ */
+static void usage(void)
+{
+	printf("Usage: avr-emu [OPTION...] SCENARIO [DAEMON-OPTION...]\n"
+	       "  -d DAEMON     run DAEMON instead of " DAEMON_LOCATION "\n"
+	       "  -v            log the messages, commands and events as they go\n"
+	       "  -h            display this usage notice\n"
+	       "\n"
+	       "The daemon is run in the foreground on a pseudo-terminal, with this\n"
+	       "program as its event script and the configuration given by the\n"
+	       "scenario.  SCENARIO, or - for the standard input, holds one directive\n"
+	       "per line:\n"
+	       "\n"
+	       "  config ... end        configuration file; rewriting it later has the\n"
+	       "                        daemon reload it\n"
+	       "  push BUTTON...        push power and/or reset, in a single write\n"
+	       "  release BUTTON...     release them\n"
+	       "  press BUTTON... [MS]  push, hold for MS (default 100) and release\n"
+	       "  fan high|fault        report the fan\n"
+	       "  halt                  ask the daemon to halt\n"
+	       "  send MESSAGE...       send fan-high, fan-fault, ack, halt, ready or \\xHH\n"
+	       "  wait MS               let MS milliseconds go by\n"
+	       "  expect CMD... [within MS]\n"
+	       "                        the next commands are CMD...: init, timer-off,\n"
+	       "                        timer-begin, wake=N (the 12-bit wake-up time),\n"
+	       "                        wake (any wake-up time), timer-end, pulse, steady,\n"
+	       "                        watchdog-off, disk-off, disk-on, disk-flash,\n"
+	       "                        disk-flash-off or fan-slow\n"
+	       "  event E [ARG] [within MS]\n"
+	       "                        the event script was called for event E; as\n"
+	       "                        handlers run side by side, in any order\n"
+	       "  quiet MS              no command or event for MS milliseconds\n"
+	       "  skip                  forget the commands and events not matched yet\n"
+	       "  ignore CMD...         drop these one-byte commands from now on\n"
+	       "  notice CMD...         stop dropping them\n"
+	       "  watchdog S            fail if the keep-alive stops for S seconds\n"
+	       "  signal hup|usr1|term  signal the daemon\n"
+	       "  stop                  terminate the daemon and wait for it\n"
+	       "  exited [within MS]    wait for the daemon to exit by itself\n"
+	       "  repeat N ... end      run the enclosed directives N times\n"
+	       "\n"
+	       "The daemon flushes the line when it opens it, so wait for init before\n"
+	       "sending anything.  Expectations wait 2000 ms by default.  The first\n"
+	       "expectation met after a message is timed, and the reply latencies are\n"
+	       "summed up at the end.  The exit status is 0 if every directive held and\n"
+	       "1 otherwise.\n");
+
+	exit(2);
+}
+
+
+/**
+ * Act as the event script: pass the event on to the emulator through the
+ * FIFO named in the environment.  With no arguments, as a persistent
+ * handler, events are read from the standard input, one per line.
+ *
+ * @return The exit status.
+ */
+static int event_script(int argc, char *argv[])
+{
+	int fd = open(getenv(EVENTS_VARIABLE), O_WRONLY | O_CLOEXEC);
+	char line[128];
+	int len;
+
+	if (fd < 0)
+		return 1;
+
+	if (argc > 1) {
+		len = snprintf(line, sizeof(line), "%s %s\n", argv[1], argc > 3 ? argv[3] : "0");
+		return write(fd, line, len) == len ? 0 : 1;
+	}
+
+	char event;
+	char arg[32];
+
+	/* Records are "E DEVICE ARG" */
+	while (fgets(line, sizeof(line), stdin)) {
+		if (sscanf(line, "%c %*s %31s", &event, arg) != 2)
+			continue;
+
+		len = snprintf(line, sizeof(line), "%c %s\n", event, arg);
+		if (write(fd, line, len) != len)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return Microseconds since an arbitrary point.
+ */
+static usec_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * Report a directive that did not hold, stop the daemon and exit.
+ */
+static void fail(const char *format, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s:%d: ", scenario_name, lineno);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+
+	cleanup();
+	exit(1);
+}
+
+
+/**
+ * Log what goes on, with the seconds since the daemon was started, when
+ * asked to with -v.
+ */
+static void note(const char *format, ...)
+{
+	va_list ap;
+
+	if (!verbose)
+		return;
+
+	printf("%9.3f ", (now_usec() - started) / 1e6);
+	va_start(ap, format);
+	vprintf(format, ap);
+	va_end(ap);
+	putchar('\n');
+	fflush(stdout);
+}
+
+
+/**
+ * Terminate the daemon, if still running, and remove the work files.
+ */
+static void cleanup(void)
+{
+	if (daemon_pid > 0) {
+		int i;
+
+		kill(daemon_pid, SIGTERM);
+		for (i = 0; i < STOP_GRACE / 10 && waitpid(daemon_pid, NULL, WNOHANG) == 0; i++)
+			usleep(10000);
+		if (i == STOP_GRACE / 10) {
+			kill(daemon_pid, SIGKILL);
+			waitpid(daemon_pid, NULL, 0);
+		}
+		daemon_pid = -1;
+	}
+
+	/* Set once the work directory exists */
+	if (config_path[0]) {
+		unlink(config_path);
+		unlink(events_path);
+		rmdir(work_dir);
+	}
+}
+
+
+/**
+ * Read scenario @a name, or the standard input for -, into lines[].
+ */
+static void read_scenario(const char *name)
+{
+	FILE *file = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+	char *line = NULL;
+	size_t size = 0;
+
+	if (!file) {
+		perror(name);
+		exit(2);
+	}
+
+	while (getline(&line, &size, file) >= 0) {
+		lines = (char **) realloc(lines, (nlines + 1) * sizeof(char *));
+		if (!lines) {
+			perror("realloc");
+			exit(2);
+		}
+		lines[nlines++] = strdup(line);
+	}
+
+	free(line);
+	if (file != stdin)
+		fclose(file);
+}
+
+
+/**
+ * Split @a line into words, in place, leaving out comments.
+ *
+ * @return The number of words.
+ */
+static int split_words(char *line, char **words)
+{
+	int nwords = 0;
+
+	for (char *word = strtok(line, " \t\r\n"); word; word = strtok(NULL, " \t\r\n")) {
+		if (word[0] == '#')
+			break;
+		if (nwords == MAX_WORDS)
+			fail("too many words");
+		words[nwords++] = word;
+	}
+
+	return nwords;
+}
+
+
+/**
+ * Make the directory holding the configuration file and the FIFO from
+ * which events are read, and open the FIFO.
+ */
+static void setup_work_dir(void)
+{
+	if (!mkdtemp(work_dir)) {
+		perror(work_dir);
+		exit(2);
+	}
+
+	snprintf(config_path, sizeof(config_path), "%s/avr-evtd", work_dir);
+	snprintf(events_path, sizeof(events_path), "%s/events", work_dir);
+
+	if (mkfifo(events_path, 0600) < 0 ||
+	    (events_fd = open(events_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0 ||
+	    (events_writer = open(events_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+		perror(events_path);
+		cleanup();
+		exit(2);
+	}
+
+	/* Start from an empty configuration rather than the one installed */
+	write_config(0, 0);
+}
+
+
+/**
+ * Write lines [@a first, @a last) of the scenario as the configuration
+ * file.  It is renamed into place, so that the daemon never reads half of
+ * it.
+ */
+static void write_config(int first, int last)
+{
+	char temp[PATH_MAX + 4];
+
+	snprintf(temp, sizeof(temp), "%s.new", config_path);
+
+	FILE *file = fopen(temp, "w");
+
+	if (!file)
+		fail("cannot write %s: %s", temp, strerror(errno));
+
+	for (int i = first; i < last; i++)
+		fputs(lines[i], file);
+
+	if (fclose(file) != 0 || rename(temp, config_path) != 0)
+		fail("cannot write %s: %s", config_path, strerror(errno));
+
+	if (daemon_pid > 0)
+		note("- config rewritten");
+}
+
+
+/**
+ * Open a pseudo-terminal and run the daemon in the foreground on it, with
+ * this program as its event script.
+ */
+static void start_daemon(void)
+{
+	char self[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	struct termios tio;
+	const char *name;
+
+	if (len < 0)
+		fail("cannot find this program: %s", strerror(errno));
+	self[len] = '\0';
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+	    grantpt(master) < 0 || unlockpt(master) < 0 || !(name = ptsname(master)))
+		fail("cannot open a pseudo-terminal: %s", strerror(errno));
+
+	/* No echo or line editing until the daemon sets the line up itself */
+	if ((slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 || tcgetattr(slave, &tio) < 0)
+		fail("cannot open %s: %s", name, strerror(errno));
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	const char **argv = (const char **) calloc(ndaemon_args + 10, sizeof(char *));
+	int argc = 0;
+
+	if (!argv)
+		fail("out of memory");
+
+	/* Options given on the command line come later, and so win */
+	argv[argc++] = daemon_path;
+	argv[argc++] = "-c";
+	argv[argc++] = "-d";
+	argv[argc++] = name;
+	argv[argc++] = "-s";
+	argv[argc++] = self;
+	argv[argc++] = "-f";
+	argv[argc++] = config_path;
+	for (int i = 0; i < ndaemon_args; i++)
+		argv[argc++] = daemon_args[i];
+
+	setenv(EVENTS_VARIABLE, events_path, 1);
+	started = now_usec();
+
+	if ((daemon_pid = fork()) < 0)
+		fail("cannot fork: %s", strerror(errno));
+
+	if (daemon_pid == 0) {
+		execv(daemon_path, (char *const *) argv);
+		perror(daemon_path);
+		_exit(127);
+	}
+
+	free(argv);
+	note("- started %s on %s", daemon_path, name);
+}
+
+
+/**
+ * Take in what the daemon sends until @a until, or until @a done, if
+ * given, returns true.  Commands are checked as they come, and so is the
+ * watchdog.
+ */
+static void pump(usec_t until, bool (*done)(void))
+{
+	for (;;) {
+		usec_t now = now_usec();
+
+		reap_daemon();
+
+		if ((avr.run_length > 0 || avr.npending > 0) && now - avr.last_rx >= IDLE_GAP * 1000LL)
+			end_run(true);
+
+		if (watchdog_limit && avr.watchdog && now - avr.kicked > watchdog_limit)
+			fail("watchdog expired: no keep-alive for %.3f s",
+			     (now - avr.kicked) / 1e6);
+
+		if ((done && done()) || now >= until)
+			return;
+
+		struct pollfd fds[2] = {
+			{ master, POLLIN, 0 },
+			{ events_fd, POLLIN, 0 },
+		};
+		int wait = (until - now + 999) / 1000;
+
+		if (wait > IDLE_GAP)
+			wait = IDLE_GAP;
+
+		if (poll(fds, 2, wait) <= 0)
+			continue;
+
+		if (fds[0].revents & POLLIN) {
+			unsigned char buff[256];
+			ssize_t res = read(master, buff, sizeof(buff));
+
+			now = now_usec();
+			for (ssize_t i = 0; i < res; i++)
+				feed_byte(buff[i], now);
+
+			/* A whole number of repeats is taken as it is, so that
+			 * expectations do not wait for the line to go quiet */
+			if (avr.run_length % CMD_REPEAT == 0)
+				end_run(false);
+		}
+
+		if (fds[1].revents & POLLIN)
+			read_events();
+	}
+}
+
+
+/**
+ * Take a byte from the daemon, which repeats every byte CMD_REPEAT times.
+ */
+static void feed_byte(unsigned char byte, usec_t at)
+{
+	if (avr.run_length > 0 && byte != avr.run_byte)
+		end_run(false);
+
+	avr.run_byte = byte;
+	avr.run_length++;
+	avr.last_rx = at;
+}
+
+
+/**
+ * Turn the repeated byte taken in so far into commands.  @a idle is set
+ * when the line went quiet, so that a command waiting for more bytes is
+ * complete.
+ */
+static void end_run(bool idle)
+{
+	if (avr.run_length % CMD_REPEAT != 0)
+		fail("byte 0x%02X repeated %d times instead of a multiple of %d",
+		     avr.run_byte, avr.run_length, CMD_REPEAT);
+
+	for (int i = 0; i < avr.run_length / CMD_REPEAT; i++) {
+		if (!ignored[avr.run_byte]) {
+			if (rx.length == RX_SIZE)
+				fail("too many commands not matched");
+			rx.data[rx.length] = avr.run_byte;
+			rx.at[rx.length++] = avr.last_rx;
+		}
+
+		if (avr.npending == PENDING_SIZE)
+			decode_pending(true);
+		avr.pending[avr.npending++] = avr.run_byte;
+	}
+
+	avr.run_length = 0;
+	decode_pending(idle);
+}
+
+
+/**
+ * Decode the commands among the bytes taken in, to follow the state of
+ * the AVR.
+ */
+static void decode_pending(bool final)
+{
+	token t;
+
+	while (avr.npending > 0 && next_token(avr.pending, avr.npending, final, &t)) {
+		apply_token(&t);
+		avr.npending -= t.length;
+		memmove(avr.pending, avr.pending + t.length, avr.npending);
+	}
+}
+
+
+/**
+ * Pick the command at the start of @a data.  The longest match wins, so
+ * that the '>' of the timer sequence is not taken for timer-off.
+ *
+ * @param final Set if no more bytes are to come.
+ *
+ * @return false if more bytes are needed to tell.
+ */
+static bool next_token(const unsigned char *data, size_t length, bool final, token *t)
+{
+	size_t best_length = 0;
+
+	t->kind = TOKEN_UNKNOWN;
+	t->value = data[0];
+	t->length = 1;
+
+	/* Wake-up bits go from bit 11 down to bit 0 */
+	if ((data[0] - WAKE_BIT_BASE) / 2 == WAKE_BITS - 1) {
+		if (length < (size_t) WAKE_BITS && !final)
+			return false;
+
+		long value = 0;
+		int i;
+
+		for (i = 0; i < WAKE_BITS && i < (int) length; i++) {
+			int code = data[i] - WAKE_BIT_BASE;
+
+			if (code < 0 || code / 2 != WAKE_BITS - 1 - i)
+				break;
+			value = value << 1 | (code & 1);
+		}
+
+		if (i == WAKE_BITS) {
+			t->kind = TOKEN_WAKE;
+			t->value = value;
+			t->length = WAKE_BITS;
+		}
+
+		return true;
+	}
+
+	for (int i = 0; i < NCOMMANDS; i++) {
+		size_t n = strlen(commands[i].wire);
+
+		if (length >= n && memcmp(data, commands[i].wire, n) == 0) {
+			if (n > best_length) {
+				t->kind = i;
+				t->length = best_length = n;
+			}
+		} else if (!final && length < n && memcmp(data, commands[i].wire, length) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Put the names of the commands in @a data into @a buff.
+ */
+static void describe(const unsigned char *data, size_t length, char *buff, size_t size)
+{
+	size_t used = 0;
+	token t;
+
+	buff[0] = '\0';
+	while (length > 0 && used < size) {
+		next_token(data, length, true, &t);
+
+		if (t.kind == TOKEN_WAKE)
+			used += snprintf(buff + used, size - used, " wake=%ld", t.value);
+		else if (t.kind == TOKEN_UNKNOWN)
+			used += snprintf(buff + used, size - used, " \\x%02lX", t.value);
+		else
+			used += snprintf(buff + used, size - used, " %s", commands[t.kind].name);
+
+		data += t.length;
+		length -= t.length;
+	}
+}
+
+
+/**
+ * Update the emulated AVR with command @a t.
+ */
+static void apply_token(const token *t)
+{
+	avr.commands++;
+
+	if (t->kind == TOKEN_WAKE) {
+		avr.next_wake = t->value;
+		note("< wake=%ld (%ld minutes)", t->value, t->value * 112 / 100);
+		return;
+	}
+
+	if (t->kind == TOKEN_UNKNOWN)
+		fail("unknown command byte 0x%02lX", t->value);
+
+	const char *cmd = commands[t->kind].name;
+
+	note("< %s", cmd);
+
+	if (strcmp(cmd, "pulse") == 0 || strcmp(cmd, "steady") == 0) {
+		avr.power_led = strcmp(cmd, "pulse") == 0 ? "pulsing" : "steady";
+		avr.watchdog = true;
+		avr.kicked = avr.last_rx;
+	} else if (strcmp(cmd, "watchdog-off") == 0)
+		avr.watchdog = false;
+	else if (strcmp(cmd, "init") == 0 || strcmp(cmd, "timer-off") == 0)
+		avr.wake = -1;
+	else if (strcmp(cmd, "timer-end") == 0)
+		avr.wake = avr.next_wake;
+	else if (strncmp(cmd, "disk-", 5) == 0)
+		avr.disk_led = cmd + 5;
+}
+
+
+/**
+ * Queue the events the event script passed on through the FIFO.
+ */
+static void read_events(void)
+{
+	ssize_t res;
+
+	while ((res = read(events_fd, event_line + event_line_length,
+			   sizeof(event_line) - 1 - event_line_length)) > 0) {
+		event_line_length += res;
+		event_line[event_line_length] = '\0';
+
+		char *end;
+
+		while ((end = strchr(event_line, '\n'))) {
+			emu_event ev = { event_line[0], 0, now_usec() };
+
+			*end = '\0';
+			sscanf(event_line, "%*c %d", &ev.arg);
+			note("! event %c %d", ev.name, ev.arg);
+
+			if (nevents == MAX_EVENTS)
+				fail("too many events not matched");
+			events[nevents++] = ev;
+
+			event_line_length -= end + 1 - event_line;
+			memmove(event_line, end + 1, event_line_length + 1);
+		}
+	}
+}
+
+
+/**
+ * Note the exit of the daemon.
+ */
+static void reap_daemon(void)
+{
+	if (daemon_pid > 0 && waitpid(daemon_pid, &daemon_status, WNOHANG) == daemon_pid) {
+		daemon_pid = -1;
+		if (WIFEXITED(daemon_status))
+			note("- daemon exited with status %d", WEXITSTATUS(daemon_status));
+		else
+			note("- daemon killed by signal %d", WTERMSIG(daemon_status));
+	}
+}
+
+
+/**
+ * Send @a length bytes of @a data to the daemon as the AVR would.
+ */
+static void send_raw(const char *data, size_t length, const char *what)
+{
+	/* Replies still in flight belong to what was sent before */
+	pump(now_usec(), NULL);
+
+	if (write(master, data, length) != (ssize_t) length)
+		fail("cannot write to the daemon: %s", strerror(errno));
+
+	input_at = now_usec();
+	input_pending = true;
+	note("> %s", what);
+}
+
+
+/**
+ * Count the reply that came at @a at towards the latency figures, if it
+ * is the first since a message was sent.
+ */
+static void record_reply(usec_t at)
+{
+	checks++;
+	if (!input_pending || at < input_at)
+		return;
+
+	usec_t latency = at - input_at;
+
+	if (replies == 0 || latency < latency_min)
+		latency_min = latency;
+	if (latency > latency_max)
+		latency_max = latency;
+	latency_sum += latency;
+	replies++;
+	input_pending = false;
+}
+
+
+/**
+ * Parse a count, or a number of milliseconds or seconds.
+ */
+static long parse_number(const char *word)
+{
+	char *end;
+	long value = strtol(word, &end, 10);
+
+	if (*end || end == word || value < 0)
+		fail("bad number: %s", word);
+
+	return value;
+}
+
+
+static int find_button(const char *name)
+{
+	for (int i = 0; i < NBUTTONS; i++)
+		if (strcmp(buttons[i].name, name) == 0)
+			return i;
+
+	fail("unknown button: %s", name);
+}
+
+
+static int find_command(const char *name)
+{
+	for (int i = 0; i < NCOMMANDS; i++)
+		if (strcmp(commands[i].name, name) == 0)
+			return i;
+
+	fail("unknown command: %s", name);
+}
+
+
+/**
+ * Take a trailing "within MS" off @a nargs.
+ *
+ * @return The time allowed, in milliseconds.
+ */
+static long take_within(char **args, int *nargs)
+{
+	if (*nargs >= 2 && strcmp(args[*nargs - 2], "within") == 0) {
+		*nargs -= 2;
+		return parse_number(args[*nargs + 1]);
+	}
+
+	return DEFAULT_WITHIN;
+}
+
+
+static void buttons_to(char **args, int nargs, bool push)
+{
+	char data[8];
+	char what[64];
+	int n = 0;
+
+	snprintf(what, sizeof(what), "%s", push ? "push" : "release");
+	for (int i = 0; i < nargs; i++) {
+		int b = find_button(args[i]);
+
+		data[n++] = push ? buttons[b].push : buttons[b].release;
+		strncat(what, " ", sizeof(what) - strlen(what) - 1);
+		strncat(what, args[i], sizeof(what) - strlen(what) - 1);
+	}
+
+	send_raw(data, n, what);
+}
+
+
+static void do_push(char **args, int nargs)
+{
+	buttons_to(args, nargs, true);
+}
+
+
+static void do_release(char **args, int nargs)
+{
+	buttons_to(args, nargs, false);
+}
+
+
+static void do_press(char **args, int nargs)
+{
+	long hold = DEFAULT_PRESS;
+
+	if (nargs > 1 && args[nargs - 1][0] >= '0' && args[nargs - 1][0] <= '9')
+		hold = parse_number(args[--nargs]);
+
+	buttons_to(args, nargs, true);
+	pump(now_usec() + hold * 1000, NULL);
+	buttons_to(args, nargs, false);
+}
+
+
+static void do_fan(char **args, int)
+{
+	if (strcmp(args[0], "high") == 0)
+		send_raw("$", 1, "fan-high");
+	else if (strcmp(args[0], "fault") == 0)
+		send_raw("%", 1, "fan-fault");
+	else
+		fail("unknown fan report: %s", args[0]);
+}
+
+
+static void do_halt(char **, int)
+{
+	send_raw("1", 1, "halt");
+}
+
+
+static void do_send(char **args, int nargs)
+{
+	for (int i = 0; i < nargs; i++) {
+		unsigned int raw;
+		char c;
+		int j;
+
+		if (sscanf(args[i], "\\x%2x%c", &raw, &c) == 1) {
+			c = raw;
+			send_raw(&c, 1, args[i]);
+			continue;
+		}
+
+		for (j = 0; j < NMESSAGES && strcmp(messages[j].name, args[i]) != 0; j++)
+			;
+		if (j == NMESSAGES)
+			fail("unknown message: %s", args[i]);
+		send_raw(&messages[j].raw, 1, args[i]);
+	}
+}
+
+
+static void do_wait(char **args, int)
+{
+	pump(now_usec() + parse_number(args[0]) * 1000, NULL);
+}
+
+
+/**
+ * Check the commands received against the expected ones.
+ *
+ * @return true once they are all in, and fails on the first difference.
+ */
+static bool rx_matches(void)
+{
+	for (size_t i = 0; i < rx.length && i < expected.length; i++) {
+		unsigned char want = expected.want[i];
+
+		if (rx.data[i] == want || (expected.any_bit[i] && rx.data[i] == want + 1))
+			continue;
+
+		char got[256], wanted[256];
+
+		describe(rx.data, rx.length, got, sizeof(got));
+		describe(expected.want, expected.length, wanted, sizeof(wanted));
+		fail("expected%s, got%s", wanted, got);
+	}
+
+	return rx.length >= expected.length;
+}
+
+
+static void do_expect(char **args, int nargs)
+{
+	long within = take_within(args, &nargs);
+
+	expected.length = 0;
+	for (int i = 0; i < nargs; i++) {
+		if (strncmp(args[i], "wake", 4) == 0) {
+			long value = 0;
+			bool any = strcmp(args[i], "wake") == 0;
+
+			if (!any && (sscanf(args[i], "wake=%ld", &value) != 1 || value < 0 || value >= 1 << WAKE_BITS))
+				fail("bad wake-up time: %s", args[i]);
+
+			for (int bit = WAKE_BITS - 1; bit >= 0; bit--) {
+				expected.want[expected.length] = WAKE_BIT_BASE + bit * 2 + (any ? 0 : value >> bit & 1);
+				expected.any_bit[expected.length++] = any;
+			}
+			continue;
+		}
+
+		const char *wire = commands[find_command(args[i])].wire;
+
+		for (; *wire; wire++) {
+			expected.want[expected.length] = *wire;
+			expected.any_bit[expected.length++] = false;
+		}
+	}
+
+	pump(now_usec() + within * 1000, rx_matches);
+
+	if (!rx_matches()) {
+		char got[256];
+
+		describe(rx.data, rx.length, got, sizeof(got));
+		fail("timed out after %ld ms, got%s", within, rx.length ? got : " nothing");
+	}
+
+	record_reply(rx.at[expected.length - 1]);
+	rx.length -= expected.length;
+	memmove(rx.data, rx.data + expected.length, rx.length);
+	memmove(rx.at, rx.at + expected.length, rx.length * sizeof(usec_t));
+}
+
+
+/**
+ * Look for the event wanted among those not matched yet.  Handlers run
+ * side by side, so events need not come in the order they were raised.
+ *
+ * @return true if it is there.
+ */
+static bool have_event(void)
+{
+	for (size_t i = 0; i < nevents; i++) {
+		if (events[i].name == wanted_event.name &&
+		    (wanted_event.arg < 0 || events[i].arg == wanted_event.arg)) {
+			wanted_index = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+static void do_event(char **args, int nargs)
+{
+	long within = take_within(args, &nargs);
+
+	if (nargs < 1 || nargs > 2 || strlen(args[0]) != 1)
+		fail("usage: event E [ARG] [within MS]");
+
+	wanted_event.name = args[0][0];
+	wanted_event.arg = nargs == 2 ? parse_number(args[1]) : -1;
+	pump(now_usec() + within * 1000, have_event);
+
+	if (!have_event())
+		fail("timed out after %ld ms waiting for event %s%s%s", within, args[0],
+		     nargs == 2 ? " " : "", nargs == 2 ? args[1] : "");
+
+	size_t i = wanted_index;
+
+	record_reply(events[i].at);
+	memmove(events + i, events + i + 1, (--nevents - i) * sizeof(emu_event));
+}
+
+
+static bool anything(void)
+{
+	return rx.length > 0 || nevents > 0;
+}
+
+
+static void do_quiet(char **args, int)
+{
+	pump(now_usec() + parse_number(args[0]) * 1000, anything);
+
+	if (rx.length > 0) {
+		char got[256];
+
+		describe(rx.data, rx.length, got, sizeof(got));
+		fail("expected nothing, got%s", got);
+	}
+
+	if (nevents > 0)
+		fail("expected nothing, got event %c %d", events[0].name, events[0].arg);
+
+	checks++;
+}
+
+
+static void do_skip(char **, int)
+{
+	pump(now_usec(), NULL);
+	rx.length = 0;
+	nevents = 0;
+}
+
+
+static void set_ignored(char **args, int nargs, bool ignore)
+{
+	for (int i = 0; i < nargs; i++) {
+		const char *wire = commands[find_command(args[i])].wire;
+
+		if (strlen(wire) != 1)
+			fail("only one-byte commands can be ignored: %s", args[i]);
+		ignored[(unsigned char) wire[0]] = ignore;
+	}
+}
+
+
+static void do_ignore(char **args, int nargs)
+{
+	set_ignored(args, nargs, true);
+}
+
+
+static void do_notice(char **args, int nargs)
+{
+	set_ignored(args, nargs, false);
+}
+
+
+static void do_watchdog(char **args, int)
+{
+	watchdog_limit = parse_number(args[0]) * 1000000LL;
+}
+
+
+static void do_signal(char **args, int)
+{
+	static const struct {
+		const char *name;
+		int signum;
+	} signals[] = {
+		{ "hup", SIGHUP },
+		{ "usr1", SIGUSR1 },
+		{ "term", SIGTERM },
+	};
+
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+		if (strcmp(signals[i].name, args[0]) == 0) {
+			if (daemon_pid <= 0)
+				fail("the daemon is not running");
+			kill(daemon_pid, signals[i].signum);
+			note("- signal %s", args[0]);
+			return;
+		}
+	}
+
+	fail("unknown signal: %s", args[0]);
+}
+
+
+static bool daemon_gone(void)
+{
+	return daemon_pid <= 0;
+}
+
+
+static void do_stop(char **, int)
+{
+	if (daemon_pid > 0)
+		kill(daemon_pid, SIGTERM);
+
+	pump(now_usec() + STOP_GRACE * 1000LL, daemon_gone);
+	if (daemon_pid > 0)
+		fail("the daemon did not stop");
+
+	/* Take in what it sent last */
+	pump(now_usec() + IDLE_GAP * 1000LL, NULL);
+}
+
+
+static void do_exited(char **args, int nargs)
+{
+	long within = take_within(args, &nargs);
+
+	pump(now_usec() + within * 1000, daemon_gone);
+	if (daemon_pid > 0)
+		fail("the daemon is still running after %ld ms", within);
+	checks++;
+}
+
+
+static const directive directives[] = {
+	{ "push",	1,	2,		do_push },
+	{ "release",	1,	2,		do_release },
+	{ "press",	1,	3,		do_press },
+	{ "fan",	1,	1,		do_fan },
+	{ "halt",	0,	0,		do_halt },
+	{ "send",	1,	MAX_WORDS,	do_send },
+	{ "wait",	1,	1,		do_wait },
+	{ "expect",	1,	MAX_WORDS,	do_expect },
+	{ "event",	1,	4,		do_event },
+	{ "quiet",	1,	1,		do_quiet },
+	{ "skip",	0,	0,		do_skip },
+	{ "ignore",	1,	MAX_WORDS,	do_ignore },
+	{ "notice",	1,	MAX_WORDS,	do_notice },
+	{ "watchdog",	1,	1,		do_watchdog },
+	{ "signal",	1,	1,		do_signal },
+	{ "stop",	0,	0,		do_stop },
+	{ "exited",	0,	2,		do_exited },
+};
+const int NDIRECTIVES = sizeof(directives) / sizeof(directives[0]);
+
+
+/**
+ * Tell whether @a line closes a block.
+ */
+static bool is_end(const char *line)
+{
+	char word[8];
+
+	return sscanf(line, "%7s", word) == 1 && strcmp(word, "end") == 0;
+}
+
+
+/**
+ * Run the directives of the scenario, starting the daemon before the
+ * first one that is not a configuration block.
+ */
+static void run_scenario(void)
+{
+	struct {
+		int line;
+		long left;
+	} loops[MAX_DEPTH];
+	int depth = 0;
+	char *words[MAX_WORDS];
+
+	for (int i = 0; i < nlines; i++) {
+		char line[1024];
+
+		lineno = i + 1;
+		snprintf(line, sizeof(line), "%s", lines[i]);
+
+		int nwords = split_words(line, words);
+
+		if (nwords == 0)
+			continue;
+
+		if (strcmp(words[0], "config") == 0) {
+			int last = i + 1;
+
+			while (last < nlines && !is_end(lines[last]))
+				last++;
+			if (last == nlines)
+				fail("config without end");
+
+			write_config(i + 1, last);
+			i = last;
+			continue;
+		}
+
+		if (strcmp(words[0], "repeat") == 0) {
+			if (nwords != 2 || depth == MAX_DEPTH)
+				fail("usage: repeat N, nested up to %d deep", MAX_DEPTH);
+			loops[depth].line = i;
+			loops[depth++].left = parse_number(words[1]);
+			if (loops[depth - 1].left == 0)
+				fail("repeat needs a count of 1 or more");
+			continue;
+		}
+
+		if (strcmp(words[0], "end") == 0) {
+			if (depth == 0)
+				fail("end without repeat");
+			if (--loops[depth - 1].left > 0)
+				i = loops[depth - 1].line;
+			else
+				depth--;
+			continue;
+		}
+
+		if (master < 0)
+			start_daemon();
+
+		int j;
+
+		for (j = 0; j < NDIRECTIVES && strcmp(directives[j].name, words[0]) != 0; j++)
+			;
+		if (j == NDIRECTIVES)
+			fail("unknown directive: %s", words[0]);
+		if (nwords - 1 < directives[j].min_args || nwords - 1 > directives[j].max_args)
+			fail("wrong number of arguments to %s", words[0]);
+
+		directives[j].run(words + 1, nwords - 1);
+	}
+
+	if (depth > 0)
+		fail("repeat without end");
+}
+
+
+int main(int argc, char *argv[])
+{
+	/* Run by the daemon as its event script */
+	if (getenv(EVENTS_VARIABLE))
+		return event_script(argc, argv);
+
+	--argc;
+	++argv;
+
+	/* Parse any options */
+	while (argc >= 1 && '-' == (*argv)[0] && (*argv)[1]) {
+		switch ((*argv)[1]) {
+		case 'd':
+			--argc;
+			++argv;
+			if (argc <= 0) {
+				printf("Option -d requires an argument.\n\n");
+				usage();
+			}
+
+			daemon_path = *argv;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			usage();
+		default:
+			printf("Option unknown: %s.\n\n", *argv);
+			usage();
+		}
+		--argc;
+		++argv;
+	}
+
+	if (argc < 1)
+		usage();
+
+	scenario_name = argv[0];
+	daemon_args = argv + 1;
+	ndaemon_args = argc - 1;
+
+	signal(SIGPIPE, SIG_IGN);
+	read_scenario(scenario_name);
+	setup_work_dir();
+	run_scenario();
+
+	lineno = nlines;
+	if (daemon_pid > 0)
+		do_stop(NULL, 0);
+
+	printf("%s: %lu checks passed, %lu commands received", scenario_name, checks, avr.commands);
+	if (replies > 0)
+		printf(", reply latency %.3f/%.3f/%.3f ms min/avg/max over %lu replies",
+		       latency_min / 1e3, latency_sum / 1e3 / replies, latency_max / 1e3, replies);
+	printf("\n");
+
+	note("- power LED %s, disk LED %s, wake-up %ld, watchdog %s", avr.power_led,
+	     avr.disk_led, avr.wake, avr.watchdog ? "on" : "off");
+
+	cleanup();
+	return 0;
+}
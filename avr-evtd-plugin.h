@@ -0,0 +1,73 @@
+/*
+ * @file avr-evtd-plugin.h
+ *
+ * Interface for event handlers loaded into the Linkstation AVR daemon
+ *
+ * Copyright © 2008-2015 Rogério Theodoro de Brito <rbrito@ime.usp.br>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ */
+#ifndef AVR_EVTD_PLUGIN_H
+#define AVR_EVTD_PLUGIN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever the structures below change */
+#define AVR_EVTD_PLUGIN_ABI	1
+
+/* Name of the function every plugin must export */
+#define AVR_EVTD_PLUGIN_INIT	"avr_evtd_plugin_init"
+
+/*
+ * An event, as otherwise passed to the EventScript on its command line.
+ */
+struct avr_evtd_event {
+	char event;		/* Event character, e.g. '7' for USER_POWER_DOWN */
+	const char *device;	/* UART connected to the AVR */
+	int arg;		/* Integer argument of the event */
+
+	/*
+	 * Send @a len commands to the AVR, one per character of @a cmds.
+	 * As usual, each command is repeated four times on the wire.
+	 * Returns 0 on success.
+	 */
+	int (*send)(const char *cmds, size_t len);
+};
+
+/*
+ * A handler run inside the daemon.  @a handle gets the event and the
+ * parameter given after the action on the command line (or NULL).  It
+ * must return quickly, as the daemon waits for it, and returns 0 if the
+ * event was handled or anything else to have the EventScript run instead.
+ */
+struct avr_evtd_plugin {
+	int abi;		/* AVR_EVTD_PLUGIN_ABI */
+	const char *name;
+	int (*handle)(const struct avr_evtd_event *ev, const char *param);
+};
+
+typedef const struct avr_evtd_plugin *(*avr_evtd_plugin_init_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AVR_EVTD_PLUGIN_H */
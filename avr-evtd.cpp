@@ -35,17 +35,35 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <limits.h>
+#include <spawn.h>
+#include <dlfcn.h>
+#include <sys/reboot.h>
 #include <linux/serial.h>
 
 #include <cstdlib>
+#include <atomic>
+
+#include "avr-evtd-plugin.h"
 
 
 /* A few defs for later */
-const int HOLD_TIME = 1;
 const int HOLD_SECONDS = 3;
 const int FIVE_MINUTES = (5*60);
 const int TWELVEHR = (12*60);
 const int TWENTYFOURHR = (TWELVEHR*2);
+const int ONE_WEEK = (TWENTYFOURHR*7);
 const int TIMER_RESOLUTION = 4095;
 const int FAN_SEIZE_TIME = 30;
 const int EM_MODE_TIME = 20;
@@ -66,71 +84,858 @@ const unsigned char FAN_FAULT = 'F';
 const unsigned char EM_MODE = 'E';
 const unsigned char FIVE_SHUTDOWN = 'S';
 const unsigned char ERRORED = 'D';
+const unsigned char DISK_FILLING = 'W';
+const unsigned char TRIPLE_PRESS = 'T';
+const unsigned char CHORD_PRESS = 'C';
 
 /* Constants for readable code */
 const unsigned char COMMENT_PREFIX = '#';
-#define CONFIG_FILE_LOCATION	"/etc/default/avr-evtd"
+#define CONFIG_DIR_LOCATION	"/etc/default"
+#define CONFIG_FILE_NAME	"avr-evtd"
+#define CONFIG_FILE_LOCATION	CONFIG_DIR_LOCATION "/" CONFIG_FILE_NAME
+#define EVENT_SCRIPT_LOCATION	"/etc/avr-evtd/EventScript"
+#define MOUNTINFO_LOCATION	"/proc/self/mountinfo"
+#define LOCALTIME_LOCATION	"/etc/localtime"
 #define VERSION			"Linkstation/Kuro AVR daemon 1.7.7\n"
-const int CMD_LINE_LENGTH = 64;
+const int ARG_LENGTH = 16;
+const int CMD_REPEAT = 4;		/* Each command is sent this many times */
+const int CMD_MAX_BYTES = 4;		/* Longest sequence sent as one command */
+const int FRAME_MAX_CMDS = 32;		/* Commands that fit in a single frame */
+const size_t RX_RING_SIZE = 256;	/* Raw bytes buffered from the UART */
+const size_t MSG_QUEUE_SIZE = 64;	/* Decoded messages awaiting dispatch */
+const size_t DISPATCH_QUEUE_SIZE = 32;	/* Events waiting for a handler */
+const int MAX_HANDLERS = 4;		/* Event script instances run at once */
+const int HANDLER_SLOTS = 16;		/* Children tracked at once */
+const int KILL_GRACE = 5;		/* Seconds between SIGTERM and SIGKILL */
+const int MAX_ACTIONS = 16;		/* In-process actions given with -a */
+const int HIST_BUCKETS = 28;		/* Powers of two, 1 us up to 134 s */
+const int MAX_FILESYSTEMS = 16;		/* Filesystems monitored at once */
+const int PROBE_DEADLINE = 10;		/* Seconds a disk probe may take */
+const int FILL_SAMPLES = 8;		/* Free space readings kept per filesystem */
+const int MIN_DISK_INTERVAL = 5;	/* Fastest disk check, in seconds */
+const int IDLE_DISK_FACTOR = 4;		/* Quiet disks are checked this much less */
+const int MAX_ZONE_CHANGES = 8;		/* UTC offset changes looked ahead for */
+const long ZONE_HORIZON = 14 * 24 * 3600L;	/* Look-ahead of the zone table */
+const int PRESS_GAP = 500;		/* Milliseconds between presses of a sequence */
+const int CHORD_GAP = 250;		/* Milliseconds between the pushes of a chord */
+const int MAX_PRESSES = 3;		/* Presses told apart, up to a triple press */
+const int MAX_EXTENSIONS = 9;		/* Five minute delays of a timed shutdown */
+const size_t GESTURE_QUEUE_SIZE = 8;	/* Gestures awaiting action */
+const long WAKE_OFF = -1;		/* AVR timer not in use */
+const long WAKE_UNKNOWN = -2;		/* AVR timer may have been set by others */
+
+/*
+ * Macro events of a week, compiled into minutes from Sunday 00:00.  The
+ * array is sorted and free of duplicates once week_compile() has run.
+ */
+struct schedule {
+	long *when;		/* Minute of the week of each event */
+	int count;
+	int size;		/* Allocated entries */
+};
+
+/*
+ * UTC offsets of the local zone over the next couple of weeks.  Segment
+ * i runs from start[i] up to start[i + 1], or until for the last one.
+ * The table is rebuilt when it runs out or the zone is changed.
+ */
+struct zone_table {
+	time_t from;
+	time_t until;
+	int count;
+	time_t start[MAX_ZONE_CHANGES + 1];
+	long offset[MAX_ZONE_CHANGES + 1];	/* Seconds east of UTC */
+	ino_t ino;		/* Identity of /etc/localtime and TZ it was built for */
+	time_t mtime;
+	char tz[64];
+};
+
+/* Next shutdown and power-on, worked out in absolute time */
+struct timer_plan {
+	time_t off_at;		/* 0 when there is no shutdown to come */
+	time_t on_at;		/* 0 when there is no power-on after it */
+};
+
+/* Milliseconds and microseconds on CLOCK_MONOTONIC */
+typedef long long msec_t;
+typedef long long usec_t;
+
+/*
+ * A transaction with the AVR, accumulated in memory and sent to the UART
+ * with a single write, so that the sequence reaches the device in one piece.
+ */
+struct uart_frame {
+	char data[FRAME_MAX_CMDS * CMD_REPEAT];
+	size_t length;
+};
+
+/* Commands understood by the AVR */
+enum avr_cmd {
+	CMD_INIT,		/* Clear the memory and reset the timer */
+	CMD_TIMER_OFF,		/* Leave timer mode */
+	CMD_TIMER_BEGIN,	/* A new wake-up time follows */
+	CMD_WAKE_BIT,		/* One bit of the wake-up time */
+	CMD_TIMER_END,		/* End of the wake-up time */
+	CMD_PULSE,		/* Keep-alive, power LED pulsing in timer mode */
+	CMD_STEADY,		/* Keep-alive, power LED steady */
+	CMD_WATCHDOG_OFF,	/* Stop the watchdog timer */
+	CMD_DISK_LED_OFF,	/* DISK FULL LED */
+	CMD_DISK_LED_ON,
+	CMD_DISK_FLASH,		/* DISK FULL LED flashing */
+	CMD_DISK_FLASH_OFF,
+	CMD_FAN_SLOW,		/* Slow the fan down again */
+	NCMDS
+};
+
+/*
+ * A command as sent to the AVR: each of its bytes in turn.  A command
+ * taking an argument is a single byte, to which the argument is added.
+ */
+struct avr_command {
+	avr_cmd cmd;
+	const char *bytes;
+	int args;		/* Values the argument may take, 0 for none */
+};
+
+/* Commands ready to go on the wire, each byte repeated CMD_REPEAT times */
+struct avr_wire {
+	char data[CMD_MAX_BYTES * CMD_REPEAT];
+	size_t length;
+};
+
+struct avr_encoding {
+	avr_wire wire[NCMDS];
+};
+
+/* Messages sent to us by the AVR */
+enum avr_msg_type {
+	MSG_POWER_RELEASE,	/* ' ' */
+	MSG_POWER_PUSH,		/* '!' */
+	MSG_RESET_RELEASE,	/* '"' */
+	MSG_RESET_PUSH,		/* '#' */
+	MSG_FAN_HIGH,		/* '$' */
+	MSG_FAN_FAULT,		/* '%' */
+	MSG_ACK,		/* '0' */
+	MSG_HALT,		/* '1' */
+	MSG_INIT_DONE,		/* '3' */
+	MSG_UNKNOWN
+};
+
+/* A message as sent by the AVR */
+struct avr_message {
+	avr_msg_type type;
+	unsigned char byte;
+};
+
+/* Message type of each byte the AVR may send */
+struct avr_lookup {
+	avr_msg_type type[256];
+};
+
+struct avr_msg {
+	avr_msg_type type;
+	unsigned char raw;	/* Byte as received, for diagnostics */
+	usec_t received;	/* When read() returned it */
+	usec_t decoded;		/* When it was decoded */
+};
+
+/* Steps an event goes through, each timed into its own histogram */
+enum trace_stage {
+	STAGE_DECODE,		/* read() returned -> message decoded */
+	STAGE_DISPATCH,		/* message decoded -> event dispatched */
+	STAGE_START,		/* event dispatched -> handler started */
+	STAGE_RUN,		/* handler started -> handler exited */
+	NSTAGES
+};
+
+/* Latencies, counted in buckets of powers of two microseconds */
+struct latency_hist {
+	unsigned long count[HIST_BUCKETS];
+};
+
+/*
+ * How events of each kind are let through to the event script.  Events
+ * without a rate limit are never held back: they bypass the queue and
+ * the limit on running handlers, so that a storm of fan or disk messages
+ * cannot delay a shutdown.
+ */
+struct event_policy {
+	unsigned char event;
+	const char *name;
+	bool coalesce;		/* Drop a repeat still waiting in the queue */
+	int burst;		/* Token bucket size, 0 for no limit */
+	int per_minute;		/* Token bucket refill rate */
+	int timeout;		/* Seconds a handler may run, 0 for no limit */
+};
+
+/* A child process we are waiting for */
+struct handler_slot {
+	pid_t pid;		/* 0 if the slot is free */
+	int pidfd;		/* Becomes readable on exit, -1 if unsupported */
+	int policy;		/* Index into policies, -1 for the persistent handler */
+	usec_t started;
+	msec_t deadline;	/* When to signal the handler, 0 for never */
+	bool terminated;	/* SIGTERM already sent */
+};
+
+/* What became of the handlers of each kind of event */
+struct handler_stats {
+	unsigned long runs;
+	unsigned long failures;	/* Non-zero exit status or killed by a signal */
+	unsigned long killed;	/* Ran past their timeout */
+	msec_t total;		/* Sum of durations */
+	msec_t longest;
+};
+
+/* Events waiting for a free handler slot */
+struct dispatch_queue {
+	struct {
+		unsigned char event;
+		int arg;
+		usec_t dispatched;
+	} entries[DISPATCH_QUEUE_SIZE];
+	size_t head;
+	size_t tail;
+	int running;		/* Handlers started and not yet reaped */
+};
+
+/* A mounted filesystem */
+struct mount_entry {
+	dev_t dev;		/* Device number, as in st_dev */
+	char *mount_point;
+};
+
+/*
+ * Cache of the mount table.  It is only read again when the kernel flags
+ * a change with POLLPRI on the open mountinfo file.
+ */
+struct mount_table {
+	int fd;			/* Open mountinfo file, or -1 */
+	mount_entry *entries;
+	size_t count;
+	size_t size;		/* Allocated entries */
+};
+
+/* A run of characters of the configuration file, not NUL-terminated */
+struct span {
+	const char *ptr;
+	size_t len;
+};
+
+/* Free space of a filesystem at some point in time */
+struct fill_sample {
+	msec_t when;
+	unsigned int free_ppm;	/* Available blocks, parts per million */
+};
+
+/* A filesystem to monitor, as configured */
+struct fs_spec {
+	char name[PATH_MAX];	/* Block device or mount point */
+	bool is_device;		/* Under /dev, a block device unless stat() says not */
+	signed char block_pct;	/* Full above this % of blocks, -1 for DISKCHECK */
+	signed char inode_pct;	/* Full above this % of inodes, 0 to ignore */
+	signed char hysteresis;	/* Points below the threshold to be clear again */
+};
+
+/* What is known of the usage of a monitored filesystem */
+struct fs_monitor {
+	bool full;		/* Either of the two below */
+	bool block_full;
+	bool inode_full;
+	bool missing;		/* Not mounted, or did not answer the probe */
+	fill_sample samples[FILL_SAMPLES];	/* Ring of the latest readings */
+	int nsamples;
+	int next_sample;	/* Ring slot to overwrite */
+	unsigned char sampled;	/* Probe the latest reading came from */
+	double fill_rate;	/* Parts per million used up per second */
+	long to_full;		/* Seconds until full, -1 if not filling */
+	bool filling;		/* Early warning given */
+};
+
+/*
+ * Settings read from the configuration file.  A reload is parsed into the
+ * spare one of two snapshots, which only takes over from the current one
+ * if the whole file is valid.
+ */
+struct config {
+	int timer_flag;		/* Timed shutdown and power-on */
+	long off_time;		/* Default shutdown time, -1 for none */
+	long on_time;		/* Default power-on time, -1 for none */
+	schedule off_timer;	/* Macro shutdown events */
+	schedule on_timer;	/* Macro power-on events */
+	int max_pct;		/* DISKCHECK, -1 when off */
+	int refresh_rate;
+	int hold_cycle;
+	int press_gap;		/* PRESSGAP, in milliseconds */
+	int chord_gap;		/* CHORDGAP, in milliseconds */
+	char pester_message;
+	int fill_warning;	/* Minutes to full that raise DISK_FILLING */
+	int fan_fault_seize;
+	int ndisks;
+	fs_spec disks[MAX_FILESYSTEMS];	/* ROOT, WORK and DISK entries */
+	unsigned int generation;	/* Bumped each time a file is taken in */
+};
+
+/* Outcome of a statfs() on one filesystem, published by the disk worker */
+struct probe_result {
+	unsigned char gen;	/* Request it answers */
+	unsigned char ok;	/* Filesystem mounted and readable */
+	unsigned char block_pct;
+	unsigned char inode_pct;
+};
+
+/*
+ * Disk usage is probed by a worker thread so that a filesystem that hangs
+ * never holds up the main loop.  The main loop fills in the mount points
+ * and posts a request while the worker is idle; the worker stores each
+ * result as soon as it has it and signals done_fd once all are in.
+ */
+struct disk_prober {
+	pthread_t thread;
+	bool threaded;		/* Worker is running, else probe inline */
+	int request_fd;		/* eventfd waking the worker */
+	int done_fd;		/* eventfd polled by the main loop */
+	std::atomic<bool> busy;	/* Worker owns paths[] until cleared */
+	std::atomic<int> probing;	/* Entry in statfs(), -1 if none */
+	unsigned char gen;	/* Request number */
+	unsigned int config_gen;	/* Configuration the request was made for */
+	unsigned int prev_config_gen;	/* Same, for the request before it */
+	msec_t started;		/* When the request was posted */
+	bool overdue;		/* Reported as still running */
+	int count;
+	char paths[MAX_FILESYSTEMS][PATH_MAX];	/* Empty when not mounted */
+	std::atomic<probe_result> results[MAX_FILESYSTEMS];
+	std::atomic<unsigned int> free_ppm[MAX_FILESYSTEMS];	/* Stored before results[] */
+};
+
+/* An in-process handler chosen for an event with -a */
+struct event_action {
+	unsigned char event;
+	const avr_evtd_plugin *plugin;
+	const char *param;	/* Whatever followed the action, or NULL */
+};
+
+/* Descriptors the main loop sleeps on */
+struct evloop {
+	int epfd;		/* epoll instance */
+	int sigfd;		/* SIGTERM, SIGINT, SIGHUP, SIGCHLD and SIGUSR1 */
+	int timer_fd;		/* Armed at the earliest pending job */
+	int clock_fd;		/* Cancelled whenever the wall clock is set */
+	int config_fd;		/* inotify watch on the configuration directory */
+};
+
+/* Jobs run by the main loop when their deadline is reached */
+enum job_id {
+	JOB_PING,		/* Keep-alive to the AVR watchdog */
+	JOB_CONFIG,		/* Configuration file reload */
+	JOB_DISK,		/* Disk usage check */
+	JOB_DISK_RESULT,	/* Disk probe finished or overran */
+	JOB_FAN,		/* Fan fault re-check */
+	JOB_GESTURE,		/* Button hold time or press window over */
+	JOB_PAUSE,		/* End of the shutdown pause window */
+	JOB_SHUTDOWN,		/* Five minute warning or timed shutdown */
+	JOB_HANDLERS,		/* Event handler ran out of time */
+	JOB_CLOCK,		/* Wall clock was set */
+	NJOBS
+};
+
+/*
+ * Binary min-heap of job deadlines.  Each job is queued at most once, so
+ * that rescheduling a job simply moves its deadline.
+ */
+struct scheduler {
+	msec_t when[NJOBS];	/* Deadline of each job */
+	job_id heap[NJOBS];	/* Queued jobs, earliest first */
+	int index[NJOBS];	/* Position of each job in heap, or -1 */
+	int size;
+	int fd;			/* timerfd armed at the earliest deadline */
+};
+
+/*
+ * Incremental decoder for the byte stream coming from the AVR.  Raw input
+ * is kept in a ring buffer and consumed byte by byte, so that several
+ * messages delivered by a single read() are all seen, and so that the
+ * PARMRK escape sequences (\377 \377 for a literal \377, \377 \0 c for a
+ * character received with a parity or framing error) may be split across
+ * reads.
+ */
+struct avr_decoder {
+	unsigned char ring[RX_RING_SIZE];
+	size_t ring_head;	/* Next byte to be decoded */
+	size_t ring_tail;	/* Next free slot */
+	usec_t received;	/* When the last read() returned */
+	enum { RX_NORMAL, RX_MARK, RX_ERROR } state;
+	avr_msg queue[MSG_QUEUE_SIZE];
+	size_t queue_head;
+	size_t queue_tail;
+};
+
+/*
+ * An entry of the transition table of a state machine: in @a state, on
+ * @a event, go to @a next and carry out @a action.  Tables are indexed by
+ * state and event and each entry repeats its own, so that check_table()
+ * can tell a missing or misplaced one at compile time.
+ */
+template <typename S, typename E, typename A>
+struct transition {
+	S state;
+	E event;
+	S next;
+	A action;
+};
+
+/* The power button at the front and the reset button at the rear */
+enum button_id {
+	BUTTON_POWER,
+	BUTTON_RESET,
+	NBUTTONS
+};
+
+enum gesture_kind {
+	GESTURE_PRESS,		/* One or more presses in quick succession */
+	GESTURE_HOLD,		/* Held down for the hold time */
+	GESTURE_LONG_HOLD,	/* Held down for the long hold time */
+	GESTURE_CHORD		/* Both buttons pushed together */
+};
+
+struct gesture {
+	gesture_kind kind;
+	button_id button;	/* Pushed last, for a chord */
+	int presses;		/* For GESTURE_PRESS */
+};
+
+/* Where a button is in a gesture */
+enum button_state {
+	BTN_IDLE,		/* Up, nothing to report */
+	BTN_DOWN,		/* Down, may yet be a press, a hold or a chord */
+	BTN_UP,			/* Up, another press may follow */
+	BTN_HELD,		/* Down past the hold time */
+	BTN_SPENT,		/* Down, nothing more to report */
+	NBTN_STATES
+};
+
+enum button_event {
+	BTN_PUSH,
+	BTN_RELEASE,
+	BTN_HOLD_OVER,		/* Hold time reached */
+	BTN_LONG_OVER,		/* Long hold time reached */
+	BTN_GAP_OVER,		/* No further press came */
+	BTN_CHORD,		/* Other button pushed together with it */
+	BTN_INTERRUPT,		/* Other button pushed on its own */
+	NBTN_EVENTS
+};
+
+enum button_action {
+	BA_NONE,
+	BA_START,		/* Note when it went down */
+	BA_COUNT,		/* Count a press */
+	BA_FLUSH,		/* Report the presses counted */
+	BA_HOLD,		/* Report a hold */
+	BA_LONG_HOLD,		/* Report a long hold */
+	BA_CHORD		/* Report the presses counted, the chord follows */
+};
+
+struct button_fsm {
+	button_state state;
+	int presses;		/* Presses not reported yet */
+	msec_t pushed;		/* When it last went down */
+	msec_t released;	/* When it last came up */
+};
+
+/*
+ * Recogniser for presses, holds and chords of the buttons.  It is fed the
+ * time of every push and release and is otherwise woken at the deadline
+ * it asks for, so that each gesture is reported as soon as it can no
+ * longer turn into another one.  Times are in milliseconds.
+ */
+struct gesture_engine {
+	int press_gap;		/* Longest pause between presses of a sequence */
+	int chord_gap;		/* Longest time between the pushes of a chord */
+	int hold[NBUTTONS];	/* Hold time of each button, 0 for none */
+	int long_hold[NBUTTONS];	/* Long hold time, 0 for none */
+	button_fsm buttons[NBUTTONS];
+	gesture queue[GESTURE_QUEUE_SIZE];
+	size_t queue_head;
+	size_t queue_tail;
+};
+
+/* Fan as reported by the AVR */
+enum fan_state {
+	FAN_OK,
+	FAN_SLOWING,		/* Asked to slow down again */
+	FAN_STOPPED,		/* Failed, waiting for it to start again */
+	FAN_FAILED,		/* Failed for longer than FANSTOP */
+	FAN_HIGH,		/* Running at high speed */
+	NFAN_STATES
+};
+
+enum fan_event {
+	FAN_EV_HIGH,		/* AVR reports high speed */
+	FAN_EV_FAULT,		/* AVR reports a failure */
+	FAN_EV_TIMER,		/* JOB_FAN is due */
+	NFAN_EVENTS
+};
+
+enum fan_action {
+	FA_NONE,
+	FA_RECHECK,		/* Try slowing it down in five minutes */
+	FA_REPORT,		/* Tell the EventScript, wait for FANSTOP */
+	FA_GIVE_UP,		/* Tell the EventScript it did not restart */
+	FA_SLOW_DOWN		/* Ask the AVR to slow it down */
+};
+
+/* Timed shutdown, from the five minute warning onwards */
+enum shutdown_state {
+	SD_ARMED,		/* Counting down to the warning */
+	SD_WARNED,		/* Warning given */
+	SD_PAUSED,		/* Put off by the user, who may do so again */
+	SD_DOWN,		/* Shutdown requested */
+	NSD_STATES
+};
+
+enum shutdown_event {
+	SD_DUE,			/* JOB_SHUTDOWN is due, five minutes or more left */
+	SD_WARN_DUE,		/* Less than five minutes left */
+	SD_TIME_UP,		/* Countdown over */
+	SD_PRESS,		/* Power button pressed */
+	SD_PAUSE_OVER,		/* No press for SP_MONITOR_TIME */
+	SD_REARM,		/* Shutdown time worked out again */
+	NSD_EVENTS
+};
+
+enum shutdown_action {
+	SA_NONE,
+	SA_PASS,		/* Press is not for us */
+	SA_RESCHEDULE,		/* Wait for the next deadline */
+	SA_WARN,		/* Give the five minute warning */
+	SA_EXTEND,		/* Put the shutdown off by five minutes */
+	SA_RESUME,		/* Report the delay and count down again */
+	SA_SHUTDOWN,		/* Have the EventScript shut down */
+	SA_CANCEL		/* Shutdown never came, count down to the next */
+};
+
+struct shutdown_fsm {
+	shutdown_state state;
+	int extensions;		/* Since the warning */
+	bool extended;		/* Ever put off, the AVR timer is left alone */
+};
+
+enum led_state {
+	LED_UNKNOWN,
+	LED_OFF,
+	LED_ON,
+	LED_FLASHING
+};
+
+/*
+ * What the front panel and the timer of the AVR were last told, so that
+ * only changes are sent.  The keep-alive, which also sets the power LED,
+ * goes out at least every REFRESH seconds for the watchdog.  Commands
+ * sent by plugins make the panel unknown again; those echoed to the
+ * device by the EventScript cannot be seen.
+ */
+struct avr_panel {
+	avr_cmd keep_alive;	/* CMD_PULSE in timer mode, else CMD_STEADY */
+	avr_cmd power_led;	/* Keep-alive last sent, NCMDS if unknown */
+	msec_t kicked;		/* When it was sent */
+	led_state disk_led;
+	long wake;		/* Wake-up time programmed, or WAKE_OFF/UNKNOWN */
+	time_t wake_at;		/* Power-on it stands for */
+	fan_state fan;
+	unsigned long sent;	/* Commands written */
+	unsigned long skipped;	/* Commands found redundant */
+};
 
-/* Macro event object definition */
-struct event {
-	int day;		/* Event day */
-	long time;		/* Event time (24h) */
-	struct event *next;	/* Pointer to next event */
+static char avr_device[PATH_MAX] = "/dev/ttyS1";
+static const char *event_script = EVENT_SCRIPT_LOCATION;
+static char config_file[PATH_MAX] = CONFIG_FILE_LOCATION;
+static char config_dir[PATH_MAX] = CONFIG_DIR_LOCATION;	/* Watched for changes */
+static const char *config_name = CONFIG_FILE_NAME;	/* Last component of config_file */
+static bool persistent_handler = false;	/* Feed events to one script instance */
+static int handler_fd = -1;		/* Pipe to the persistent handler */
+static pid_t handler_pid = -1;		/* Process id of the persistent handler */
+
+static constexpr event_policy policies[] = {
+	{ SPECIAL_RESET,	"SPECIAL_RESET",	false,	4,	10,	120 },
+	{ AVR_HALT,		"AVR_HALT",		false,	0,	0,	0 },
+	{ TIMED_SHUTDOWN,	"TIMED_SHUTDOWN",	false,	0,	0,	0 },
+	{ POWER_RELEASE,	"POWER_RELEASE",	false,	10,	60,	30 },
+	{ POWER_PRESS,		"POWER_PRESS",		false,	10,	60,	30 },
+	{ RESET_RELEASE,	"RESET_RELEASE",	false,	10,	60,	30 },
+	{ RESET_PRESS,		"RESET_PRESS",		false,	10,	60,	30 },
+	{ USER_POWER_DOWN,	"USER_POWER_DOWN",	false,	0,	0,	0 },
+	{ USER_RESET,		"USER_RESET",		false,	0,	0,	0 },
+	{ DISK_FULL,		"DISK_FULL",		true,	2,	4,	30 },
+	{ FAN_FAULT,		"FAN_FAULT",		true,	3,	6,	30 },
+	{ EM_MODE,		"EM_MODE",		false,	0,	0,	0 },
+	{ FIVE_SHUTDOWN,	"FIVE_SHUTDOWN",	true,	4,	10,	30 },
+	{ ERRORED,		"ERRORED",		true,	3,	6,	30 },
+	{ DISK_FILLING,		"DISK_FILLING",		true,	2,	4,	30 },
+	{ TRIPLE_PRESS,		"TRIPLE_PRESS",		false,	10,	60,	30 },
+	{ CHORD_PRESS,		"CHORD_PRESS",		false,	10,	60,	30 },
 };
+const int NPOLICIES = sizeof(policies) / sizeof(policies[0]);
 
-typedef struct event event;
+/*
+ * The AVR protocol.  Whatever differs between the Linkstation and
+ * Kurobox models is to be told apart here and only here.
+ */
+static constexpr avr_command avr_commands[NCMDS] = {
+	{ CMD_INIT,		"AFJ>",	0 },
+	{ CMD_TIMER_OFF,	">",	0 },
+	{ CMD_TIMER_BEGIN,	"><:8",	0 },
+	{ CMD_WAKE_BIT,		" ",	24 },	/* Plus 2 * bit + value */
+	{ CMD_TIMER_END,	"?",	0 },
+	{ CMD_PULSE,		"[",	0 },
+	{ CMD_STEADY,		"Z",	0 },
+	{ CMD_WATCHDOG_OFF,	"K",	0 },
+	{ CMD_DISK_LED_OFF,	"V",	0 },
+	{ CMD_DISK_LED_ON,	"W",	0 },
+	{ CMD_DISK_FLASH,	"Y",	0 },
+	{ CMD_DISK_FLASH_OFF,	"X",	0 },
+	{ CMD_FAN_SLOW,		"\\",	0 },
+};
+
+static constexpr avr_message avr_messages[] = {
+	{ MSG_POWER_RELEASE,	' ' },
+	{ MSG_POWER_PUSH,	'!' },
+	{ MSG_RESET_RELEASE,	'"' },
+	{ MSG_RESET_PUSH,	'#' },
+	{ MSG_FAN_HIGH,		'$' },
+	{ MSG_FAN_FAULT,	'%' },
+	{ MSG_ACK,		'0' },
+	{ MSG_HALT,		'1' },
+	{ MSG_INIT_DONE,	'3' },
+};
+
+typedef transition<button_state, button_event, button_action> button_transition;
+typedef transition<fan_state, fan_event, fan_action> fan_transition;
+typedef transition<shutdown_state, shutdown_event, shutdown_action> shutdown_transition;
+
+static constexpr button_transition button_table[NBTN_STATES][NBTN_EVENTS] = {
+	{
+		{ BTN_IDLE,	BTN_PUSH,	BTN_DOWN,	BA_START },
+		{ BTN_IDLE,	BTN_RELEASE,	BTN_IDLE,	BA_NONE },
+		{ BTN_IDLE,	BTN_HOLD_OVER,	BTN_IDLE,	BA_NONE },
+		{ BTN_IDLE,	BTN_LONG_OVER,	BTN_IDLE,	BA_NONE },
+		{ BTN_IDLE,	BTN_GAP_OVER,	BTN_IDLE,	BA_NONE },
+		{ BTN_IDLE,	BTN_CHORD,	BTN_IDLE,	BA_NONE },
+		{ BTN_IDLE,	BTN_INTERRUPT,	BTN_IDLE,	BA_NONE },
+	}, {
+		{ BTN_DOWN,	BTN_PUSH,	BTN_DOWN,	BA_NONE },
+		{ BTN_DOWN,	BTN_RELEASE,	BTN_UP,		BA_COUNT },
+		{ BTN_DOWN,	BTN_HOLD_OVER,	BTN_HELD,	BA_HOLD },
+		{ BTN_DOWN,	BTN_LONG_OVER,	BTN_SPENT,	BA_LONG_HOLD },
+		{ BTN_DOWN,	BTN_GAP_OVER,	BTN_DOWN,	BA_NONE },
+		{ BTN_DOWN,	BTN_CHORD,	BTN_SPENT,	BA_CHORD },
+		{ BTN_DOWN,	BTN_INTERRUPT,	BTN_DOWN,	BA_FLUSH },
+	}, {
+		{ BTN_UP,	BTN_PUSH,	BTN_DOWN,	BA_START },
+		{ BTN_UP,	BTN_RELEASE,	BTN_UP,		BA_NONE },
+		{ BTN_UP,	BTN_HOLD_OVER,	BTN_UP,		BA_NONE },
+		{ BTN_UP,	BTN_LONG_OVER,	BTN_UP,		BA_NONE },
+		{ BTN_UP,	BTN_GAP_OVER,	BTN_IDLE,	BA_FLUSH },
+		{ BTN_UP,	BTN_CHORD,	BTN_UP,		BA_NONE },
+		{ BTN_UP,	BTN_INTERRUPT,	BTN_IDLE,	BA_FLUSH },
+	}, {
+		{ BTN_HELD,	BTN_PUSH,	BTN_HELD,	BA_NONE },
+		{ BTN_HELD,	BTN_RELEASE,	BTN_IDLE,	BA_NONE },
+		{ BTN_HELD,	BTN_HOLD_OVER,	BTN_HELD,	BA_NONE },
+		{ BTN_HELD,	BTN_LONG_OVER,	BTN_SPENT,	BA_LONG_HOLD },
+		{ BTN_HELD,	BTN_GAP_OVER,	BTN_HELD,	BA_NONE },
+		{ BTN_HELD,	BTN_CHORD,	BTN_HELD,	BA_NONE },
+		{ BTN_HELD,	BTN_INTERRUPT,	BTN_HELD,	BA_NONE },
+	}, {
+		{ BTN_SPENT,	BTN_PUSH,	BTN_SPENT,	BA_NONE },
+		{ BTN_SPENT,	BTN_RELEASE,	BTN_IDLE,	BA_NONE },
+		{ BTN_SPENT,	BTN_HOLD_OVER,	BTN_SPENT,	BA_NONE },
+		{ BTN_SPENT,	BTN_LONG_OVER,	BTN_SPENT,	BA_NONE },
+		{ BTN_SPENT,	BTN_GAP_OVER,	BTN_SPENT,	BA_NONE },
+		{ BTN_SPENT,	BTN_CHORD,	BTN_SPENT,	BA_NONE },
+		{ BTN_SPENT,	BTN_INTERRUPT,	BTN_SPENT,	BA_NONE },
+	}
+};
 
-static char avr_device[] = "/dev/ttyS1";
+static constexpr fan_transition fan_table[NFAN_STATES][NFAN_EVENTS] = {
+	{
+		{ FAN_OK,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+		{ FAN_OK,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+		{ FAN_OK,	FAN_EV_TIMER,	FAN_OK,		FA_NONE },
+	}, {
+		{ FAN_SLOWING,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+		{ FAN_SLOWING,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+		{ FAN_SLOWING,	FAN_EV_TIMER,	FAN_OK,		FA_NONE },
+	}, {
+		{ FAN_STOPPED,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+		{ FAN_STOPPED,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+		{ FAN_STOPPED,	FAN_EV_TIMER,	FAN_FAILED,	FA_GIVE_UP },
+	}, {
+		{ FAN_FAILED,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+		{ FAN_FAILED,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+		{ FAN_FAILED,	FAN_EV_TIMER,	FAN_FAILED,	FA_NONE },
+	}, {
+		{ FAN_HIGH,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+		{ FAN_HIGH,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+		{ FAN_HIGH,	FAN_EV_TIMER,	FAN_SLOWING,	FA_SLOW_DOWN },
+	}
+};
+
+/* Argument of FAN_FAULT reported in each state, as the EventScript knows it */
+static constexpr int fan_code[NFAN_STATES] = { 0, 1, 2, 5, 6 };
+
+static constexpr shutdown_transition shutdown_table[NSD_STATES][NSD_EVENTS] = {
+	{
+		{ SD_ARMED,	SD_DUE,		SD_ARMED,	SA_RESCHEDULE },
+		{ SD_ARMED,	SD_WARN_DUE,	SD_WARNED,	SA_WARN },
+		{ SD_ARMED,	SD_TIME_UP,	SD_DOWN,	SA_SHUTDOWN },
+		{ SD_ARMED,	SD_PRESS,	SD_ARMED,	SA_PASS },
+		{ SD_ARMED,	SD_PAUSE_OVER,	SD_ARMED,	SA_NONE },
+		{ SD_ARMED,	SD_REARM,	SD_ARMED,	SA_NONE },
+	}, {
+		{ SD_WARNED,	SD_DUE,		SD_WARNED,	SA_RESCHEDULE },
+		{ SD_WARNED,	SD_WARN_DUE,	SD_WARNED,	SA_RESCHEDULE },
+		{ SD_WARNED,	SD_TIME_UP,	SD_DOWN,	SA_SHUTDOWN },
+		{ SD_WARNED,	SD_PRESS,	SD_PAUSED,	SA_EXTEND },
+		{ SD_WARNED,	SD_PAUSE_OVER,	SD_WARNED,	SA_NONE },
+		{ SD_WARNED,	SD_REARM,	SD_WARNED,	SA_NONE },
+	}, {
+		/* Jobs are held off until the pause is over */
+		{ SD_PAUSED,	SD_DUE,		SD_PAUSED,	SA_NONE },
+		{ SD_PAUSED,	SD_WARN_DUE,	SD_PAUSED,	SA_NONE },
+		{ SD_PAUSED,	SD_TIME_UP,	SD_PAUSED,	SA_NONE },
+		{ SD_PAUSED,	SD_PRESS,	SD_PAUSED,	SA_EXTEND },
+		{ SD_PAUSED,	SD_PAUSE_OVER,	SD_ARMED,	SA_RESUME },
+		{ SD_PAUSED,	SD_REARM,	SD_PAUSED,	SA_NONE },
+	}, {
+		/* Left on the next press, or when the configuration or the
+		 * clock change, should the system not go down after all */
+		{ SD_DOWN,	SD_DUE,		SD_DOWN,	SA_NONE },
+		{ SD_DOWN,	SD_WARN_DUE,	SD_DOWN,	SA_NONE },
+		{ SD_DOWN,	SD_TIME_UP,	SD_DOWN,	SA_NONE },
+		{ SD_DOWN,	SD_PRESS,	SD_ARMED,	SA_CANCEL },
+		{ SD_DOWN,	SD_PAUSE_OVER,	SD_DOWN,	SA_NONE },
+		{ SD_DOWN,	SD_REARM,	SD_ARMED,	SA_NONE },
+	}
+};
+
+static dispatch_queue dispatcher;
+static double tokens[NPOLICIES];	/* Tokens left in each bucket */
+static msec_t refilled[NPOLICIES];	/* When each bucket was last refilled */
+static bool throttled[NPOLICIES];	/* Bucket ran dry, already reported */
+static handler_slot handlers[HANDLER_SLOTS];
+static handler_stats stats[NPOLICIES];
+static int epoll_fd = -1;		/* Main loop, once it is set up */
+static event_action actions[MAX_ACTIONS];
+static int nactions;
+static mount_table mounts = { -1, NULL, 0, 0 };
+static disk_prober prober;
+static latency_hist latency[NPOLICIES][NSTAGES];
+static const avr_msg *current_msg;	/* AVR message being acted upon */
+
+static config configs[2];
+static const config *cfg = &configs[0];	/* Only swapped by check_timer() */
 
-event *off_timer;
-event *on_timer;
 int serialfd;
-time_t last_config_mtime;
-int timer_flag;
 long shutdown_timer = 9999;	/* Careful here */
-char first_time_flag = 1;
+static shutdown_fsm countdown = { SD_ARMED, 0, false };
 char first_warning = 1;
-long off_time = -1;		/* Default, NO defaults */
-long on_time = -1;		/* Default, NO defaults */
 
-char command_line_update = 1;
-
-int max_pct = 90;
 int last_day;			/* Day of week.	[0-6] */
-int refresh_rate = 40;
-int hold_cycle = 3;
-char pester_message;
-int fan_fault_seize = 30;
-int check_state = 1;	/* Will force an update within 15 seconds of starting
-			   up to resolve those pushed out refresh times. */
+static zone_table zone;
+static timer_plan plan;
+scheduler timers;
+msec_t last_shutdown_mono;	/* When shutdown_timer was last brought up to date */
 char in_em_mode = 0;
-char root_device[10];		/* root filesystem device */
-char work_device[10];		/* work filesystem device */
-int diskcheck_number;
-char keep_alive = 0x5B;		/* '[' */
+fs_monitor monitors[MAX_FILESYSTEMS];	/* State of each of cfg->disks */
+static avr_panel panel = { CMD_PULSE, NCMDS, 0, LED_UNKNOWN, WAKE_UNKNOWN, 0, FAN_OK, 0, 0 };
 char reset_presses;
 int pct_used;
 
 /* Function declarations */
 static void usage(void);
+static int set_config_file(const char *path);
 static void check_timer(int type);
 static void termination_handler(int signum);
 static int open_serial(char *device, char probe);
 
 static void close_serial(void);
 static void avr_evtd_main(void);
-static char check_disk(void);
+static int setup_evloop(evloop *loop);
+static msec_t mono_now(void);
+static usec_t mono_usec(void);
+static void record_latency(int policy, trace_stage stage, usec_t delta);
+static void log_latency(void);
+static void sched_init(scheduler *s);
+static void sched_at(scheduler *s, job_id job, msec_t when);
+static void sched_in(scheduler *s, job_id job, long seconds);
+static void sched_cancel(scheduler *s, job_id job);
+static bool sched_pop(scheduler *s, msec_t now, job_id *job);
+static void sched_arm(scheduler *s);
+static void update_shutdown_timer(void);
+static int arm_clock_watch(int fd);
+static bool clock_was_set(int fd);
+static void schedule_shutdown(void);
+static void handle_signals(int sigfd);
+static int probe_init(disk_prober *p);
+static bool probe_start(disk_prober *p);
+static int check_disk(bool *missing);
+static long disk_interval(void);
+static int refresh_mounts(mount_table *table);
+static const char *find_mount(mount_table *table, dev_t dev);
+static const char *add_monitor(config *c, span spec, bool legacy);
+static void sync_monitors(const config *old);
+static void config_defaults(config *c);
 static void set_avr_timer(int type);
-static void parse_config(char *content);
-static void get_time(long now, event *pTimerLocate, long *time, long default_time);
-static int find_next_today(long now, event *pTimer, long *time);
-static int find_next_day(event * pTimer, long *time, long *offset);
-static void destroy_timer(event *e);
-static void write_to_uart(char);
+static bool parse_config(const char *content, size_t length, config *c);
+static size_t span_int(span s, int *value);
+static void get_time(long now, const schedule *week, long *time, long default_time);
+static void week_add(schedule *week, int day, long time);
+static void week_compile(schedule *week);
+static bool zone_changed(const zone_table *z);
+static void zone_build(zone_table *z, time_t now);
+static time_t zone_local(const zone_table *z, time_t t);
+static time_t zone_utc(const zone_table *z, time_t local);
+static void format_local(char *buff, size_t size, time_t t);
+static time_t next_event(const schedule *week, long default_time, time_t after);
+static void avr_send(avr_cmd cmd);
+static void frame_cmd(uart_frame *frame, avr_cmd cmd);
+static void panel_keep_alive(void);
+static void panel_disk_led(led_state want);
+static void panel_forget(void);
+static void log_panel(void);
+static void frame_reset(uart_frame *frame);
+static void frame_add(uart_frame *frame, char cmd);
+static int frame_flush(uart_frame *frame);
+static void decoder_reset(avr_decoder *dec);
+static ssize_t decoder_fill(avr_decoder *dec, int fd);
+static void decoder_run(avr_decoder *dec);
+static bool decoder_next(avr_decoder *dec, avr_msg *msg);
+static void gesture_reset(gesture_engine *g);
+static void gesture_input(gesture_engine *g, button_id button, bool down, msec_t when);
+static void gesture_expire(gesture_engine *g, msec_t now);
+static msec_t gesture_deadline(const gesture_engine *g);
+static bool gesture_busy(const gesture_engine *g);
+static bool gesture_next(gesture_engine *g, gesture *out);
+static void configure_gestures(gesture_engine *g);
+static void run_gestures(gesture_engine *g);
+static bool shutdown_run(shutdown_event event);
+static void fan_run(fan_state *fan, fan_event event);
 static void report_error(int number);
 static void exec_simple_cmd(char cmd);
+static void loop_signals(sigset_t *mask);
+static bool config_changed(int fd);
+static int spawn_script(char *const argv[], int input, pid_t *pid);
+static void launch_event(unsigned char event, int arg, usec_t dispatched);
+static void dispatch_run(void);
+static void reap_children(void);
+static int policy_index(unsigned char event);
+static bool track_child(pid_t pid, int policy);
+static void check_handler_timeouts(void);
+static void log_handler_stats(void);
+static int add_action(char *spec);
+static bool run_actions(unsigned char event, int arg);
+static int start_handler(void);
+static int send_to_handler(char cmd1, const char *arg);
 static void exec_cmd(char cmd, int cmd2);
 
 
@@ -144,12 +949,55 @@ static void usage(void)
 	       "  -i            display memory location for device used with -d\n"
 	       "  -c            run in the foreground, not as a daemon\n"
 	       "  -e            force the device to enter emergency mode\n"
+	       "  -s SCRIPT     run SCRIPT on events instead of " EVENT_SCRIPT_LOCATION "\n"
+	       "  -f FILE       read the configuration from FILE instead of " CONFIG_FILE_LOCATION "\n"
+	       "  -p            keep SCRIPT running and send events to its standard input\n"
+	       "  -a E:ACTION   handle event E in the daemon; ACTION is led:CMDS, syslog,\n"
+	       "                halt, reboot or the path of a plugin, with an optional :PARAM\n"
 	       "  -v            display program version\n"
 	       "  -h            display this usage notice\n");
 	exit(1);
 }
 
 
+/**
+ * Read the configuration from @a path rather than the default location.
+ * A relative path is made absolute, as the daemon changes to the root
+ * directory when it goes to the background.
+ *
+ * @param path Name of the configuration file.
+ *
+ * @return 0 on success and -1 if the name does not fit.
+ */
+static int set_config_file(const char *path)
+{
+	char cwd[PATH_MAX] = "";
+
+	if (path[0] != '/' && !getcwd(cwd, sizeof(cwd)))
+		return -1;
+
+	size_t length = strlen(cwd) + strlen(path) + 1;
+
+	if (length >= sizeof(config_file))
+		return -1;
+
+	strcpy(config_file, cwd);
+	if (cwd[0])
+		strcat(config_file, "/");
+	strcat(config_file, path);
+
+	/* The directory is watched, and the file picked out by name */
+	char *slash = strrchr(config_file, '/');
+	size_t dir_length = slash == config_file ? 1 : slash - config_file;
+
+	memcpy(config_dir, config_file, dir_length);
+	config_dir[dir_length] = '\0';
+	config_name = slash + 1;
+
+	return 0;
+}
+
+
 /**
  * Ensure that value lies in the interval [@a lower, @a upper]. To avoid
  * degenerate cases, we assume that @a lower <= @a upper.
@@ -167,621 +1015,3364 @@ static inline void ensure_limits(T &value, T lower, T upper)
 
 
 /**
- * Write command to the UART.  The character received by the function is sent
- * to the UART 4 (four) times in a row.
- *
- * @param cmd The command to be sent to the UART.
+ * Check that @a table has the entry of each state and event in its place
+ * and that it only leads to valid states.
  */
-static void write_to_uart(char cmd)
+template <typename S, typename E, typename A, size_t NS, size_t NE>
+constexpr bool check_table(const transition<S, E, A> (&table)[NS][NE])
 {
-	char output[4];
-	output[0] = output[1] = output[2] = output[3] = cmd;
-	write(serialfd, output, 4);
+	for (size_t s = 0; s < NS; s++)
+		for (size_t e = 0; e < NE; e++)
+			if ((size_t) table[s][e].state != s || (size_t) table[s][e].event != e
+			    || (size_t) table[s][e].next >= NS)
+				return false;
+
+	return true;
 }
 
 
 /**
- * Establish connection to serial port.
- *
- * @param device A string containing the device to be used to communicate
- * with the UART.
- *
- * @param probe_only The value false if we are opening the device for regular use or
- *              	 true if we just want to probe the memory address associated
- *              	 with @a device.
- *
- * @return A negative value if problems were encountered while opening @a
- * device.
+ * Check that every state of @a table can be reached from @a initial.
  */
-static int open_serial(char *device, bool probe_only)
+template <typename S, typename E, typename A, size_t NS, size_t NE>
+constexpr bool check_reachable(const transition<S, E, A> (&table)[NS][NE], S initial)
 {
-	struct termios newtio;
+	bool seen[NS] = {};
 
-	/* Need read/write access to the AVR */
-	if ((serialfd = open(device, O_RDWR | O_NOCTTY)) < 0) {
-		perror(device);
-		return -1;
-	}
+	seen[initial] = true;
+	for (size_t pass = 0; pass < NS; pass++)
+		for (size_t s = 0; s < NS; s++)
+			for (size_t e = 0; e < NE && seen[s]; e++)
+				seen[table[s][e].next] = true;
 
-	if (probe_only) {
-		struct serial_struct serinfo;
+	for (size_t s = 0; s < NS; s++)
+		if (!seen[s])
+			return false;
 
-		ioctl(serialfd, TIOCGSERIAL, &serinfo);
+	return true;
+}
 
-		if (serinfo.iomem_base)
-			printf("%p\n", serinfo.iomem_base);
-		else
-			printf("%X\n", serinfo.port);
+static_assert(check_table(button_table), "button transitions out of place");
+static_assert(check_reachable(button_table, BTN_IDLE), "unreachable button state");
+static_assert(check_table(fan_table), "fan transitions out of place");
+static_assert(check_reachable(fan_table, FAN_OK), "unreachable fan state");
+static_assert(check_table(shutdown_table), "shutdown transitions out of place");
+static_assert(check_reachable(shutdown_table, SD_ARMED), "unreachable shutdown state");
 
-		return 0;
-	}
 
-	ioctl(serialfd, TCFLSH, 2);
-	/* Clear data structures */
-	memset(&newtio, 0, sizeof(newtio));
-	newtio.c_iflag = PARMRK;
-	newtio.c_oflag = OPOST;
-	newtio.c_cflag = PARENB | CLOCAL | CREAD | CSTOPB | CS8 | B9600;
+/**
+ * Check that every event raised by the daemon has a dispatch policy, as
+ * the per-policy counters are indexed by it.
+ */
+static constexpr bool check_policies(void)
+{
+	constexpr unsigned char events[] = {
+		SPECIAL_RESET, AVR_HALT, TIMED_SHUTDOWN, POWER_RELEASE, POWER_PRESS,
+		RESET_RELEASE, RESET_PRESS, USER_POWER_DOWN, USER_RESET, DISK_FULL,
+		FAN_FAULT, EM_MODE, FIVE_SHUTDOWN, ERRORED, DISK_FILLING,
+		TRIPLE_PRESS, CHORD_PRESS
+	};
 
-	/* Update tty settings */
-	ioctl(serialfd, TCSETS, &newtio);
-	ioctl(serialfd, TCFLSH, 2);
+	for (size_t e = 0; e < sizeof(events); e++) {
+		int found = 0;
 
-	/* Initialize the AVR device: clear memory and reset the timer */
-	write_to_uart(0x41);	/* 'A' */
-	write_to_uart(0x46);	/* 'F' */
-	write_to_uart(0x4A);	/* 'J' */
-	write_to_uart(0x3E);	/* '>' */
+		for (int i = 0; i < NPOLICIES; i++)
+			if (policies[i].event == events[e])
+				found++;
 
-	/* Remove flashing DISK LED */
-	write_to_uart(0x58);	/* 'X' */
+		if (found != 1)
+			return false;
+	}
 
-	return 0;
+	return true;
 }
 
+static_assert(check_policies(), "event without a single dispatch policy");
+
 
 /**
+ * Feed @a event to a state machine.
  *
- * Close the serial port associated with @a serialfd.
- *
- * Before the closing of the file descriptor, a command is sent to the UART
- * so that it will stop the watchdog timer. This is not necessary when
- * powering off the machine, but *is* important when the system
- * administrator has, for some reason, stopped the daemon for some kind of
- * maintenance.
+ * @param table Transitions of the machine.
+ * @param state Current state, updated.
+ * @param event What happened.
  *
- * FIXME: The memory used by the linked list of events is freed. This should
- * probably be better to keep split in another function. Also, the file
- * descriptor used for syslog is closed (optional, but nice).  Perhaps the
- * function should just be renamed, instead of being split in many smaller
- * functions?
+ * @return The action to be carried out.
  */
-static void close_serial(void)
+template <typename S, typename E, typename A, size_t NS, size_t NE>
+static inline A fsm_step(const transition<S, E, A> (&table)[NS][NE], S *state, E event)
 {
-	if (serialfd != 0) {
-		/* Stop the watchdog timer */
-		write_to_uart(0x4B);	/* 'K' */
-		close(serialfd);
-	}
-
-	/* Destroy the macro timer objects */
-	destroy_timer(off_timer);
-	destroy_timer(on_timer);
+	const transition<S, E, A> &t = table[*state][event];
 
-	closelog();
+	*state = t.next;
+	return t.action;
 }
 
 
 /**
- * Set up termination handlers when receiving signals.
- *
- * @param signum The number of the signal received by the daemon.
+ * Empty @a frame so that a new transaction can be accumulated into it.
  *
+ * @param frame The frame to be cleared.
  */
-static void termination_handler(int signum)
+static void frame_reset(uart_frame *frame)
 {
-	switch (signum) {
-	case SIGTERM:
-		close_serial();
-		exit(EXIT_SUCCESS);
-	default:
-		break;
-	}
+	frame->length = 0;
 }
 
 
 /**
- * Execute event script handler (put in background in a shell) with the
- * commands passed as parameters.
- *
- * @param cmd1 First part of the command to the event script. A single character.
- * @param cmd2 Second part of the command to the event script. An integer.
+ * Append a command to @a frame.  As with every command sent to the AVR, the
+ * character is repeated CMD_REPEAT times in a row.
  *
+ * @param frame The frame being built.
+ * @param cmd The command to be appended.
  */
-static void exec_cmd(char cmd1, int cmd2)
+static void frame_add(uart_frame *frame, char cmd)
 {
-	char cmd_line[CMD_LINE_LENGTH];
+	if (frame->length + CMD_REPEAT > sizeof(frame->data)) {
+		syslog(LOG_ERR, "UART frame overflow, dropping command %X", cmd);
+		return;
+	}
 
-	sprintf(cmd_line, "/etc/avr-evtd/EventScript %c %s %d &",
-		cmd1, avr_device, cmd2);
-	system(cmd_line);
+	memset(frame->data + frame->length, cmd, CMD_REPEAT);
+	frame->length += CMD_REPEAT;
 }
 
 
 /**
- * Abbreviated version of the executioner of the event script handler.
- *
- * @param cmd Command to be sent to the event script. It must consist of a
- * single character.
+ * Write @a length bytes to the UART.  Short writes are resumed and, should
+ * the descriptor be non-blocking, we wait for it to become writable again
+ * instead of dropping the tail of the transaction.
  *
+ * @return 0 on success and -1 if the UART refused the data.
  */
-static void exec_simple_cmd(char cmd)
+static int uart_write(const char *data, size_t length)
 {
-	exec_cmd(cmd, 0);
-}
+	size_t sent = 0;
 
+	/* Closed after an AVR halt */
+	if (serialfd < 0)
+		return -1;
 
-/**
- * Our main entry, decode requests and monitor activity
- */
-static void avr_evtd_main(void)
-{
-	char buf[17];
-	char cmd;
-	char pushed_power = 0;
-	char pushed_reset = 0;
-	char pressed_power_flag = 0;
-	char pressed_reset_flag = 0;
-	char current_status = 0;
-	time_t idle = time(NULL);
-	time_t power_press = idle;
-	time_t fault_time;
-	time_t last_shutdown_ping;
-	fd_set serialfd_set;
-	struct timeval timeout_poll;
-	int fan_fault = 0;
-	long time_diff;
-	char extraTime = 0;
-	char disk_full = 0;
+	panel.sent += length / CMD_REPEAT;
 
-	/* Update the shutdown timer */
-	fault_time = 0;
-	last_shutdown_ping = time(NULL);
+	while (sent < length) {
+		ssize_t res = write(serialfd, data + sent, length - sent);
+
+		if (res > 0) {
+			sent += res;
+		} else if (res < 0 && errno == EINTR) {
+			continue;
+		} else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { serialfd, POLLOUT, 0 };
+			poll(&pfd, 1, -1);
+		} else {
+			syslog(LOG_ERR, "UART write failed: %m");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Send the accumulated contents of @a frame to the UART and empty it.
+ *
+ * @param frame The frame to be sent.
+ *
+ * @return 0 on success and -1 if the UART refused the data.
+ */
+static int frame_flush(uart_frame *frame)
+{
+	int res = uart_write(frame->data, frame->length);
+
+	frame_reset(frame);
+	return res;
+}
+
+
+/**
+ * Check that each command of @a table is in its place and fits on the
+ * wire, and that only single bytes take an argument.
+ */
+template <size_t N>
+constexpr bool check_commands(const avr_command (&table)[N])
+{
+	for (size_t i = 0; i < N; i++) {
+		size_t length = 0;
+
+		while (table[i].bytes[length])
+			length++;
+
+		if ((size_t) table[i].cmd != i || length == 0 || length > (size_t) CMD_MAX_BYTES
+		    || (table[i].args > 0 && length != 1)
+		    || (unsigned char) table[i].bytes[0] + table[i].args > 0x100)
+			return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Work out the bytes on the wire of each command of @a table.
+ */
+template <size_t N>
+constexpr avr_encoding encode_commands(const avr_command (&table)[N])
+{
+	avr_encoding enc = {};
+
+	for (size_t i = 0; i < N; i++)
+		for (const char *p = table[i].bytes; *p; p++)
+			for (int r = 0; r < CMD_REPEAT; r++)
+				enc.wire[i].data[enc.wire[i].length++] = *p;
+
+	return enc;
+}
+
+
+/**
+ * Check that no two messages of @a table share a byte.
+ */
+template <size_t N>
+constexpr bool check_messages(const avr_message (&table)[N])
+{
+	for (size_t i = 0; i < N; i++)
+		for (size_t j = i + 1; j < N; j++)
+			if (table[i].byte == table[j].byte || table[i].type == table[j].type)
+				return false;
+
+	return true;
+}
+
+
+/**
+ * Work out the message type of each byte from @a table.
+ */
+template <size_t N>
+constexpr avr_lookup decode_messages(const avr_message (&table)[N])
+{
+	avr_lookup lookup = {};
+
+	for (size_t c = 0; c < 256; c++)
+		lookup.type[c] = MSG_UNKNOWN;
+	for (size_t i = 0; i < N; i++)
+		lookup.type[table[i].byte] = table[i].type;
+
+	return lookup;
+}
+
+static_assert(check_commands(avr_commands), "AVR command out of place or too long");
+static_assert(check_messages(avr_messages), "AVR message given twice");
+
+static constexpr avr_encoding avr_encoded = encode_commands(avr_commands);
+static constexpr avr_lookup avr_decoded = decode_messages(avr_messages);
+
+
+/**
+ * Append command @a cmd, which takes no argument, to @a frame.
+ */
+static void frame_cmd(uart_frame *frame, avr_cmd cmd)
+{
+	const avr_wire &wire = avr_encoded.wire[cmd];
+
+	if (frame->length + wire.length > sizeof(frame->data)) {
+		syslog(LOG_ERR, "UART frame overflow, dropping command %d", cmd);
+		return;
+	}
+
+	memcpy(frame->data + frame->length, wire.data, wire.length);
+	frame->length += wire.length;
+}
+
+
+/**
+ * Append command @a C, checked at compile time, to @a frame.
+ */
+template <avr_cmd C>
+static inline void frame_cmd(uart_frame *frame)
+{
+	static_assert(avr_commands[C].args == 0, "AVR command needs an argument");
+
+	frame_cmd(frame, C);
+}
+
+
+/**
+ * Append command @a C to @a frame, with argument @a arg.
+ */
+template <avr_cmd C>
+static inline void frame_cmd(uart_frame *frame, int arg)
+{
+	static_assert(avr_commands[C].args > 0, "AVR command takes no argument");
+
+	if (arg < 0 || arg >= avr_commands[C].args) {
+		syslog(LOG_ERR, "argument %d out of range for AVR command %d", arg, C);
+		return;
+	}
+
+	frame_add(frame, avr_commands[C].bytes[0] + arg);
+}
+
+
+/**
+ * Send command @a cmd, which takes no argument, to the UART on its own.
+ */
+static void avr_send(avr_cmd cmd)
+{
+	uart_write(avr_encoded.wire[cmd].data, avr_encoded.wire[cmd].length);
+}
+
+
+/**
+ * Send command @a C, checked at compile time, to the UART on its own.
+ */
+template <avr_cmd C>
+static inline void avr_send(void)
+{
+	static_assert(avr_commands[C].args == 0, "AVR command needs an argument");
+
+	avr_send(C);
+}
+
+
+/**
+ * Kick the watchdog, setting the power LED as it goes.
+ */
+static void panel_keep_alive(void)
+{
+	avr_send(panel.keep_alive);
+	panel.power_led = panel.keep_alive;
+	panel.kicked = mono_now();
+}
+
+
+/**
+ * Have the DISK FULL LED show @a want, unless it already does.
+ */
+static void panel_disk_led(led_state want)
+{
+	if (panel.disk_led == want) {
+		panel.skipped++;
+		return;
+	}
+
+	uart_frame frame;
+
+	frame_reset(&frame);
+	if (panel.disk_led == LED_FLASHING)
+		frame_cmd<CMD_DISK_FLASH_OFF>(&frame);
+
+	if (want == LED_FLASHING)
+		frame_cmd<CMD_DISK_FLASH>(&frame);
+	else if (want == LED_ON)
+		frame_cmd<CMD_DISK_LED_ON>(&frame);
+	else
+		frame_cmd<CMD_DISK_LED_OFF>(&frame);
+
+	frame_flush(&frame);
+	panel.disk_led = want;
+}
+
+
+/**
+ * Forget what the panel and the timer show, after commands were sent to
+ * the AVR behind our back.
+ */
+static void panel_forget(void)
+{
+	panel.power_led = NCMDS;
+	panel.disk_led = LED_UNKNOWN;
+	panel.wake = WAKE_UNKNOWN;
+}
+
+
+/**
+ * Log what the panel and the timer of the AVR were last told, and how
+ * many commands were spared.
+ */
+static void log_panel(void)
+{
+	static const char *led_name[] = { "unknown", "off", "on", "flashing" };
+	static const char *fan_name[] = { "ok", "slowing", "stopped", "failed", "high" };
+	const char *power = "unknown";
+	char wake[32] = "unknown";
+
+	if (panel.power_led == CMD_PULSE)
+		power = "pulsing";
+	else if (panel.power_led == CMD_STEADY)
+		power = "steady";
+
+	if (panel.wake == WAKE_OFF)
+		strcpy(wake, "off");
+	else if (panel.wake >= 0)
+		format_local(wake, sizeof(wake), panel.wake_at);
+
+	syslog(LOG_INFO, "panel power %s, disk %s, wake-up %s, fan %s; %lu sent, %lu skipped",
+	       power, led_name[panel.disk_led], wake, fan_name[panel.fan],
+	       panel.sent, panel.skipped);
+}
+
+
+/**
+ * Bring @a dec back to its initial, empty state.
+ *
+ * @param dec The decoder to be reset.
+ */
+static void decoder_reset(avr_decoder *dec)
+{
+	dec->ring_head = dec->ring_tail = 0;
+	dec->queue_head = dec->queue_tail = 0;
+	dec->state = avr_decoder::RX_NORMAL;
+}
+
+
+/**
+ * Read whatever is pending on @a fd into the ring buffer of @a dec.  At
+ * most the contiguous free space at the tail of the ring is filled, which
+ * is plenty for the trickle of messages that the AVR sends.
+ *
+ * @param dec The decoder receiving the data.
+ * @param fd The file descriptor to be read.
+ *
+ * @return The value returned by read(), or 0 if the ring is full.
+ */
+static ssize_t decoder_fill(avr_decoder *dec, int fd)
+{
+	size_t used = dec->ring_tail - dec->ring_head;
+	size_t offset = dec->ring_tail % RX_RING_SIZE;
+	size_t room = RX_RING_SIZE - used;
+
+	if (room > RX_RING_SIZE - offset)
+		room = RX_RING_SIZE - offset;
+
+	if (room == 0)
+		return 0;
+
+	ssize_t res = read(fd, dec->ring + offset, room);
+	if (res > 0) {
+		dec->ring_tail += res;
+		dec->received = mono_usec();
+	}
+
+	return res;
+}
+
+
+/**
+ * Translate a byte sent by the AVR into the corresponding message type.
+ */
+static avr_msg_type decode_byte(unsigned char c)
+{
+	return avr_decoded.type[c];
+}
+
+
+/**
+ * Queue a decoded message, unless the queue is full.
+ */
+static void decoder_push(avr_decoder *dec, unsigned char c)
+{
+	if (dec->queue_tail - dec->queue_head >= MSG_QUEUE_SIZE) {
+		syslog(LOG_WARNING, "AVR message queue full, dropping %X", c);
+		return;
+	}
+
+	avr_msg *msg = &dec->queue[dec->queue_tail % MSG_QUEUE_SIZE];
+	msg->type = decode_byte(c);
+	msg->raw = c;
+	msg->received = dec->received;
+	msg->decoded = mono_usec();
+	dec->queue_tail++;
+}
+
+
+/**
+ * Consume every byte buffered in @a dec, queueing the messages found.
+ *
+ * @param dec The decoder to be run.
+ */
+static void decoder_run(avr_decoder *dec)
+{
+	while (dec->ring_head != dec->ring_tail) {
+		unsigned char c = dec->ring[dec->ring_head % RX_RING_SIZE];
+		dec->ring_head++;
+
+		switch (dec->state) {
+		case avr_decoder::RX_NORMAL:
+			if (c == 0xFF)
+				dec->state = avr_decoder::RX_MARK;
+			else
+				decoder_push(dec, c);
+			break;
+
+		case avr_decoder::RX_MARK:
+			if (c == 0xFF) {	/* Escaped \377 */
+				decoder_push(dec, c);
+				dec->state = avr_decoder::RX_NORMAL;
+			} else if (c == 0x00) {
+				dec->state = avr_decoder::RX_ERROR;
+			} else {		/* Not an escape, keep both */
+				decoder_push(dec, 0xFF);
+				decoder_push(dec, c);
+				dec->state = avr_decoder::RX_NORMAL;
+			}
+			break;
+
+		case avr_decoder::RX_ERROR:
+			/* Character received with a parity/framing error (or a
+			 * break, if \0): it cannot be trusted, so drop it. */
+			syslog(LOG_INFO, "line error on AVR message %X", c);
+			dec->state = avr_decoder::RX_NORMAL;
+			break;
+		}
+	}
+
+	dec->ring_head = dec->ring_tail = 0;
+}
+
+
+/**
+ * Fetch the next decoded message from @a dec.
+ *
+ * @param dec The decoder holding the messages.
+ * @param msg Where the message is to be stored.
+ *
+ * @return true if a message was available and false otherwise.
+ */
+static bool decoder_next(avr_decoder *dec, avr_msg *msg)
+{
+	if (dec->queue_head == dec->queue_tail) {
+		dec->queue_head = dec->queue_tail = 0;
+		return false;
+	}
+
+	*msg = dec->queue[dec->queue_head % MSG_QUEUE_SIZE];
+	dec->queue_head++;
+	return true;
+}
+
+
+/**
+ * Forget any gesture in progress in @a g, keeping its hold times and
+ * windows.
+ */
+static void gesture_reset(gesture_engine *g)
+{
+	memset(g->buttons, 0, sizeof(g->buttons));
+	g->queue_head = g->queue_tail = 0;
+}
+
+
+/**
+ * Queue a gesture, unless the queue is full.
+ */
+static void gesture_emit(gesture_engine *g, gesture_kind kind, button_id button, int presses)
+{
+	if (g->queue_tail - g->queue_head == GESTURE_QUEUE_SIZE) {
+		syslog(LOG_ERR, "gesture queue overflow");
+		return;
+	}
+
+	gesture *out = &g->queue[g->queue_tail % GESTURE_QUEUE_SIZE];
+
+	out->kind = kind;
+	out->button = button;
+	out->presses = presses;
+	g->queue_tail++;
+}
+
+
+/**
+ * Report the presses of @a button counted so far, if any.
+ */
+static void gesture_flush(gesture_engine *g, button_id button)
+{
+	button_fsm *b = &g->buttons[button];
+
+	if (b->presses > 0) {
+		gesture_emit(g, GESTURE_PRESS, button, b->presses);
+		b->presses = 0;
+	}
+}
+
+
+/**
+ * Feed @a event to the machine of @a button and carry out its action.
+ *
+ * @param g The recogniser.
+ * @param button The button.
+ * @param event What happened.
+ * @param when When it happened, on the monotonic clock.
+ */
+static void button_run(gesture_engine *g, button_id button, button_event event, msec_t when)
+{
+	button_fsm *b = &g->buttons[button];
+
+	switch (fsm_step(button_table, &b->state, event)) {
+	case BA_NONE:
+		break;
+
+	case BA_START:
+		b->pushed = when;
+		break;
+
+	case BA_COUNT:
+		b->released = when;
+
+		/* Nothing can follow the last press told apart */
+		if (++b->presses == MAX_PRESSES)
+			button_run(g, button, BTN_GAP_OVER, when);
+		break;
+
+	case BA_FLUSH:
+	case BA_CHORD:
+		gesture_flush(g, button);
+		break;
+
+	case BA_HOLD:
+		gesture_flush(g, button);
+		gesture_emit(g, GESTURE_HOLD, button, 0);
+		break;
+
+	case BA_LONG_HOLD:
+		gesture_flush(g, button);
+		gesture_emit(g, GESTURE_LONG_HOLD, button, 0);
+		break;
+	}
+}
+
+
+/**
+ * When button @a i next times out, and how.
+ *
+ * @param g The recogniser.
+ * @param i The button.
+ * @param event Where the event of the time-out is stored.
+ *
+ * @return The time on the monotonic clock, or 0 if it is not waiting.
+ */
+static msec_t button_deadline(const gesture_engine *g, int i, button_event *event)
+{
+	const button_fsm *b = &g->buttons[i];
+
+	switch (b->state) {
+	case BTN_DOWN:
+		if (g->hold[i] > 0) {
+			*event = BTN_HOLD_OVER;
+			return b->pushed + g->hold[i];
+		}
+		if (g->long_hold[i] > 0) {
+			*event = BTN_LONG_OVER;
+			return b->pushed + g->long_hold[i];
+		}
+		return 0;
+
+	case BTN_HELD:
+		if (g->long_hold[i] > g->hold[i]) {
+			*event = BTN_LONG_OVER;
+			return b->pushed + g->long_hold[i];
+		}
+		return 0;
+
+	case BTN_UP:
+		*event = BTN_GAP_OVER;
+		return b->released + g->press_gap;
+
+	default:
+		return 0;
+	}
+}
+
+
+/**
+ * Feed a push or release of a button to the recogniser.
+ *
+ * @param g The recogniser.
+ * @param button The button.
+ * @param down true if it was pushed and false if it was released.
+ * @param when When the AVR reported it, on the monotonic clock.
+ */
+static void gesture_input(gesture_engine *g, button_id button, bool down, msec_t when)
+{
+	button_id other = button == BUTTON_POWER ? BUTTON_RESET : BUTTON_POWER;
+	button_fsm *b = &g->buttons[button];
+	button_fsm *o = &g->buttons[other];
+
+	/* Whatever was over by then is reported first */
+	gesture_expire(g, when);
+
+	if (!down) {
+		button_run(g, button, BTN_RELEASE, when);
+		return;
+	}
+
+	if (b->state == BTN_DOWN)
+		return;
+
+	/* Reaching for the other button ends its presses */
+	button_run(g, other, BTN_INTERRUPT, when);
+	button_run(g, button, BTN_PUSH, when);
+
+	if (b->state == BTN_DOWN && o->state == BTN_DOWN && when - o->pushed <= g->chord_gap) {
+		button_run(g, other, BTN_CHORD, when);
+		button_run(g, button, BTN_CHORD, when);
+		gesture_emit(g, GESTURE_CHORD, button, 0);
+	}
+}
+
+
+/**
+ * Report the holds and press sequences of @a g that are over by @a now.
+ */
+static void gesture_expire(gesture_engine *g, msec_t now)
+{
+	for (int i = 0; i < NBUTTONS; i++) {
+		button_event event;
+		msec_t at;
+
+		while ((at = button_deadline(g, i, &event)) && now >= at)
+			button_run(g, (button_id) i, event, at);
+	}
+}
+
+
+/**
+ * When @a g next needs gesture_expire() to be called.
+ *
+ * @return The time on the monotonic clock, or 0 if it is not waiting.
+ */
+static msec_t gesture_deadline(const gesture_engine *g)
+{
+	msec_t earliest = 0;
+
+	for (int i = 0; i < NBUTTONS; i++) {
+		button_event event;
+		msec_t at = button_deadline(g, i, &event);
+
+		if (at && (!earliest || at < earliest))
+			earliest = at;
+	}
+
+	return earliest;
+}
+
+
+/**
+ * Whether a button is down or a sequence of presses may still go on.
+ */
+static bool gesture_busy(const gesture_engine *g)
+{
+	for (int i = 0; i < NBUTTONS; i++)
+		if (g->buttons[i].state != BTN_IDLE)
+			return true;
+
+	return false;
+}
+
+
+/**
+ * Fetch the next gesture recognised by @a g.
+ *
+ * @return true if a gesture was available and false otherwise.
+ */
+static bool gesture_next(gesture_engine *g, gesture *out)
+{
+	if (g->queue_head == g->queue_tail) {
+		g->queue_head = g->queue_tail = 0;
+		return false;
+	}
+
+	*out = g->queue[g->queue_head % GESTURE_QUEUE_SIZE];
+	g->queue_head++;
+	return true;
+}
+
+
+/**
+ * Establish connection to serial port.
+ *
+ * @param device A string containing the device to be used to communicate
+ * with the UART.
+ *
+ * @param probe_only The value false if we are opening the device for regular use or
+ *              	 true if we just want to probe the memory address associated
+ *              	 with @a device.
+ *
+ * @return A negative value if problems were encountered while opening @a
+ * device.
+ */
+static int open_serial(char *device, bool probe_only)
+{
+	struct termios newtio;
+
+	/* Need read/write access to the AVR */
+	if ((serialfd = open(device, O_RDWR | O_NOCTTY)) < 0) {
+		perror(device);
+		return -1;
+	}
+
+	if (probe_only) {
+		struct serial_struct serinfo;
+
+		ioctl(serialfd, TIOCGSERIAL, &serinfo);
+
+		if (serinfo.iomem_base)
+			printf("%p\n", serinfo.iomem_base);
+		else
+			printf("%X\n", serinfo.port);
+
+		return 0;
+	}
+
+	ioctl(serialfd, TCFLSH, 2);
+	/* Clear data structures */
+	memset(&newtio, 0, sizeof(newtio));
+	newtio.c_iflag = PARMRK;
+	newtio.c_oflag = OPOST;
+	newtio.c_cflag = PARENB | CLOCAL | CREAD | CSTOPB | CS8 | B9600;
+
+	/* Update tty settings */
+	ioctl(serialfd, TCSETS, &newtio);
+	ioctl(serialfd, TCFLSH, 2);
+
+	/* Initialize the AVR device: clear memory and reset the timer */
+	uart_frame frame;
+	frame_reset(&frame);
+	frame_cmd<CMD_INIT>(&frame);
+
+	/* Remove flashing DISK LED */
+	frame_cmd<CMD_DISK_FLASH_OFF>(&frame);
+	frame_flush(&frame);
+
+	panel_forget();
+	panel.wake = WAKE_OFF;
+
+	return 0;
+}
+
+
+/**
+ *
+ * Close the serial port associated with @a serialfd.
+ *
+ * Before the closing of the file descriptor, a command is sent to the UART
+ * so that it will stop the watchdog timer. This is not necessary when
+ * powering off the machine, but *is* important when the system
+ * administrator has, for some reason, stopped the daemon for some kind of
+ * maintenance.
+ *
+ * FIXME: The memory used by the linked list of events is freed. This should
+ * probably be better to keep split in another function. Also, the file
+ * descriptor used for syslog is closed (optional, but nice).  Perhaps the
+ * function should just be renamed, instead of being split in many smaller
+ * functions?
+ */
+static void close_serial(void)
+{
+	if (serialfd > 0) {
+		/* Stop the watchdog timer */
+		avr_send<CMD_WATCHDOG_OFF>();
+		close(serialfd);
+		serialfd = -1;
+	}
+
+	/* Destroy the macro timer objects.  After an AVR halt the main loop
+	 * goes on, and a reload builds them up again. */
+	for (int i = 0; i < 2; i++) {
+		free(configs[i].off_timer.when);
+		free(configs[i].on_timer.when);
+		configs[i].off_timer.when = configs[i].on_timer.when = NULL;
+		configs[i].off_timer.count = configs[i].off_timer.size = 0;
+		configs[i].on_timer.count = configs[i].on_timer.size = 0;
+	}
+
+	closelog();
+}
+
+
+/**
+ * Act upon a termination signal.  Signals are delivered synchronously
+ * through a signalfd by the main loop, so there are no restrictions on
+ * what may be called here.
+ *
+ * @param signum The number of the signal received by the daemon.
+ *
+ */
+static void termination_handler(int signum)
+{
+	switch (signum) {
+	case SIGTERM:
+	case SIGINT:
+		log_handler_stats();
+		log_latency();
+		close_serial();
+		exit(EXIT_SUCCESS);
+	default:
+		break;
+	}
+}
+
+
+/**
+ * Drain the pending signals from @a sigfd.
+ *
+ * @param sigfd The signalfd the signals are delivered to.
+ */
+static void handle_signals(int sigfd)
+{
+	struct signalfd_siginfo info;
+
+	while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGHUP:	/* Reload the configuration file */
+			sched_at(&timers, JOB_CONFIG, mono_now());
+			break;
+		case SIGCHLD:
+			reap_children();
+			break;
+		case SIGUSR1:
+			log_latency();
+			log_panel();
+			break;
+		default:
+			termination_handler(info.ssi_signo);
+			break;
+		}
+	}
+}
+
+
+/**
+ * Fill @a mask with the signals picked up by the main loop.
+ */
+static void loop_signals(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGCHLD);
+	sigaddset(mask, SIGUSR1);
+}
+
+
+/**
+ * Create the epoll instance of the main loop along with the signal and
+ * timer descriptors it waits on, and register the UART with it.
+ *
+ * @param loop The structure receiving the descriptors.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+static int setup_evloop(evloop *loop)
+{
+	sigset_t mask;
+	struct epoll_event ev;
+
+	loop_signals(&mask);
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (loop->epfd < 0 || loop->sigfd < 0 || loop->timer_fd < 0)
+		return -1;
+
+	epoll_fd = loop->epfd;
+
+	const int fds[] = { serialfd, loop->sigfd, loop->timer_fd };
+	for (int i = 0; i < 3; i++) {
+		ev.events = EPOLLIN;
+		ev.data.fd = fds[i];
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+			return -1;
+	}
+
+	/* Countdowns run on the monotonic clock; this catches the wall
+	 * clock being set, by the user or by NTP, for the timer to be
+	 * worked out again. */
+	loop->clock_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->clock_fd >= 0 && arm_clock_watch(loop->clock_fd) == 0) {
+		ev.events = EPOLLIN;
+		ev.data.fd = loop->clock_fd;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->clock_fd, &ev);
+	} else
+		syslog(LOG_ERR, "cannot watch for changes of the clock: %m");
+
+	/* Watch the directory rather than the file, so that editors which
+	 * write a new file and rename it over the old one are noticed.
+	 * Without it, the configuration is only reloaded on SIGHUP. */
+	loop->config_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (loop->config_fd >= 0 &&
+	    inotify_add_watch(loop->config_fd, config_dir,
+			      IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.fd = loop->config_fd;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->config_fd, &ev) == 0)
+			return 0;
+	}
+
+	syslog(LOG_ERR, "cannot watch %s, reloading on SIGHUP only: %m", config_dir);
+	if (loop->config_fd >= 0)
+		close(loop->config_fd);
+	loop->config_fd = -1;
+
+	return 0;
+}
+
+
+/**
+ * Drain the inotify events pending on @a fd.
+ *
+ * @return true if any of them concerns the configuration file.
+ */
+static bool config_changed(int fd)
+{
+	char buff[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t res;
+
+	while ((res = read(fd, buff, sizeof(buff))) > 0) {
+		for (char *ptr = buff; ptr < buff + res;) {
+			const struct inotify_event *ev = (const struct inotify_event *) ptr;
+
+			if (ev->len && strcmp(ev->name, config_name) == 0)
+				changed = true;
+			ptr += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	return changed;
+}
+
+
+/**
+ * Current time on the monotonic clock, in milliseconds.
+ */
+static msec_t mono_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (msec_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Current time on the monotonic clock, in microseconds.
+ */
+static usec_t mono_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (usec_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * Count a latency of @a delta microseconds for @a stage of the events
+ * under @a policy.
+ */
+static void record_latency(int policy, trace_stage stage, usec_t delta)
+{
+	int bucket = 0;
+
+	if (policy < 0 || policy >= NPOLICIES)
+		return;
+
+	while (delta > 1 && bucket < HIST_BUCKETS - 1) {
+		delta >>= 1;
+		bucket++;
+	}
+
+	latency[policy][stage].count[bucket]++;
+}
+
+
+/**
+ * Log the latency histograms, one line per event and stage, listing the
+ * non-empty buckets by their upper bound.
+ */
+static void log_latency(void)
+{
+	static const char *stage_name[] = { "decode", "dispatch", "start", "run" };
+
+	for (int i = 0; i < NPOLICIES; i++) {
+		for (int j = 0; j < NSTAGES; j++) {
+			char line[512];
+			int len = 0;
+
+			for (int k = 0; k < HIST_BUCKETS && len < (int) sizeof(line); k++) {
+				unsigned long n = latency[i][j].count[k];
+				long long bound = 2LL << k;
+
+				if (n == 0)
+					continue;
+
+				if (k == HIST_BUCKETS - 1)
+					len += snprintf(line + len, sizeof(line) - len, " >=%lldus:%lu", bound / 2, n);
+				else if (bound < 10000)
+					len += snprintf(line + len, sizeof(line) - len, " <%lldus:%lu", bound, n);
+				else
+					len += snprintf(line + len, sizeof(line) - len, " <%lldms:%lu", bound / 1000, n);
+			}
+
+			if (len > 0)
+				syslog(LOG_INFO, "latency %s %s:%s", policies[i].name, stage_name[j], line);
+		}
+	}
+}
+
+
+/**
+ * Empty the schedule of @a s.
+ */
+static void sched_init(scheduler *s)
+{
+	for (int i = 0; i < NJOBS; i++)
+		s->index[i] = -1;
+
+	s->size = 0;
+	s->fd = -1;
+}
+
+
+/**
+ * Exchange two entries of the heap, keeping the index up to date.
+ */
+static void sched_swap(scheduler *s, int a, int b)
+{
+	job_id aux = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = aux;
+	s->index[s->heap[a]] = a;
+	s->index[s->heap[b]] = b;
+}
+
+
+/**
+ * Restore the heap property around position @a i.
+ */
+static void sched_fix(scheduler *s, int i)
+{
+	while (i > 0 && s->when[s->heap[i]] < s->when[s->heap[(i - 1) / 2]]) {
+		sched_swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		int least = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+
+		if (left < s->size && s->when[s->heap[left]] < s->when[s->heap[least]])
+			least = left;
+		if (right < s->size && s->when[s->heap[right]] < s->when[s->heap[least]])
+			least = right;
+		if (least == i)
+			break;
+
+		sched_swap(s, i, least);
+		i = least;
+	}
+}
+
+
+/**
+ * Schedule @a job to run at @a when, replacing any earlier schedule.
+ *
+ * @param s The scheduler.
+ * @param job The job to be run.
+ * @param when The deadline on the monotonic clock.
+ */
+static void sched_at(scheduler *s, job_id job, msec_t when)
+{
+	s->when[job] = when;
+
+	if (s->index[job] < 0) {
+		s->heap[s->size] = job;
+		s->index[job] = s->size++;
+	}
+
+	sched_fix(s, s->index[job]);
+}
+
+
+/**
+ * Schedule @a job to run @a seconds from now.
+ */
+static void sched_in(scheduler *s, job_id job, long seconds)
+{
+	sched_at(s, job, mono_now() + (msec_t) seconds * 1000);
+}
+
+
+/**
+ * Remove @a job from the schedule, if queued.
+ */
+static void sched_cancel(scheduler *s, job_id job)
+{
+	int i = s->index[job];
+
+	if (i < 0)
+		return;
+
+	s->index[job] = -1;
+	if (i != --s->size) {
+		s->heap[i] = s->heap[s->size];
+		s->index[s->heap[i]] = i;
+		sched_fix(s, i);
+	}
+}
+
+
+/**
+ * Take the earliest job off the schedule if it is due by @a now.
+ *
+ * @param s The scheduler.
+ * @param now The current time on the monotonic clock.
+ * @param job Where the job that is due is stored.
+ *
+ * @return true if a job was due and false otherwise.
+ */
+static bool sched_pop(scheduler *s, msec_t now, job_id *job)
+{
+	if (s->size == 0 || s->when[s->heap[0]] > now)
+		return false;
+
+	*job = s->heap[0];
+	sched_cancel(s, *job);
+	return true;
+}
+
+
+/**
+ * Arm the timerfd of @a s at the earliest deadline, or disarm it if there
+ * is nothing scheduled.
+ */
+static void sched_arm(scheduler *s)
+{
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	if (s->size > 0) {
+		msec_t when = s->when[s->heap[0]];
+
+		spec.it_value.tv_sec = when / 1000;
+		spec.it_value.tv_nsec = (when % 1000) * 1000000;
+		if (when <= 0)
+			spec.it_value.tv_nsec = 1;	/* zero would disarm the timer */
+	}
+
+	timerfd_settime(s->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+
+/**
+ * Take the time elapsed since the last update off the shutdown countdown,
+ * as measured on the monotonic clock.
+ */
+static void update_shutdown_timer(void)
+{
+	long elapsed = (mono_now() - last_shutdown_mono) / 1000;
+
+	last_shutdown_mono += (msec_t) elapsed * 1000;
+	shutdown_timer -= elapsed;
+}
+
+
+/**
+ * Arm @a fd, a CLOCK_REALTIME timerfd, so that it is cancelled as soon as
+ * the wall clock is set.  Its expiry is a year away and of no interest.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+static int arm_clock_watch(int fd)
+{
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = time(NULL) + 365 * 24 * 3600L;
+
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
+}
+
+
+/**
+ * Acknowledge @a fd, the clock watch, and arm it again.
+ *
+ * @return true if the wall clock was set.
+ */
+static bool clock_was_set(int fd)
+{
+	uint64_t expirations;
+	bool set = read(fd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED;
+
+	if (arm_clock_watch(fd) < 0)
+		syslog(LOG_ERR, "cannot watch for changes of the clock: %m");
+
+	return set;
+}
+
+
+/**
+ * (Re)schedule the shutdown job: at the five minute warning, if it is
+ * still to be given, or else when the countdown runs out.
+ */
+static void schedule_shutdown(void)
+{
+	if (cfg->timer_flag != 1 || !plan.off_at) {
+		sched_cancel(&timers, JOB_SHUTDOWN);
+		return;
+	}
+
+	long delay = shutdown_timer;
+	if (countdown.state != SD_WARNED) {
+		if (shutdown_timer >= FIVE_MINUTES)
+			delay = shutdown_timer - FIVE_MINUTES + 1;
+		else
+			delay = 0;
+	}
+
+	sched_at(&timers, JOB_SHUTDOWN, last_shutdown_mono + (msec_t) delay * 1000);
+}
+
+
+/**
+ * Start the event script in the background, with the signal mask and the
+ * dispositions of the signals we ignore reset to their defaults.
+ *
+ * @param argv The arguments to the script, the first being its path.
+ * @param input A descriptor to become the standard input of the script, or
+ * -1 to leave it alone.
+ * @param pid Where the process id of the script is stored.
+ *
+ * @return 0 on success and an error number on failure.
+ */
+static int spawn_script(char *const argv[], int input, pid_t *pid)
+{
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+	sigset_t none, reset;
+
+	sigemptyset(&none);
+	sigemptyset(&reset);
+	sigaddset(&reset, SIGCHLD);
+	sigaddset(&reset, SIGTSTP);
+	sigaddset(&reset, SIGPIPE);
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &reset);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	posix_spawn_file_actions_init(&actions);
+	if (input >= 0)
+		posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+
+	int res = posix_spawn(pid, event_script, &actions, &attr, argv, environ);
+	if (res != 0)
+		syslog(LOG_ERR, "cannot run %s: %s", event_script, strerror(res));
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	return res;
+}
+
+
+/**
+ * Start the persistent instance of the event script, with no arguments
+ * and a pipe as its standard input, from which it reads one event per
+ * line.
+ *
+ * @return 0 on success and -1 on failure.
+ */
+static int start_handler(void)
+{
+	char *argv[] = { (char *) event_script, NULL };
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		syslog(LOG_ERR, "cannot create pipe to event handler: %m");
+		return -1;
+	}
+
+	int res = spawn_script(argv, fds[0], &handler_pid);
+	close(fds[0]);
+
+	if (res != 0) {
+		close(fds[1]);
+		return -1;
+	}
+
+	track_child(handler_pid, -1);
+
+	/* Never let a slow handler hold up the daemon */
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	handler_fd = fds[1];
+
+	return 0;
+}
+
+
+/**
+ * Send an event to the persistent handler as a line holding the same
+ * three arguments the script is given on its command line.  The handler
+ * is (re)started if it is not running.
+ *
+ * @param cmd1 The event character.
+ * @param arg The integer argument, already formatted.
+ *
+ * @return 0 on success and -1 if the event could not be delivered.
+ */
+static int send_to_handler(char cmd1, const char *arg)
+{
+	char record[ARG_LENGTH + sizeof(avr_device) + 4];
+	int len = snprintf(record, sizeof(record), "%c %s %s\n", cmd1, avr_device, arg);
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (handler_fd < 0 && start_handler() < 0)
+			return -1;
+
+		if (write(handler_fd, record, len) == len)
+			return 0;
+
+		if (errno == EAGAIN) {
+			syslog(LOG_WARNING, "event handler busy, dropping event %c", cmd1);
+			return 0;
+		}
+
+		/* The handler went away, start a new one */
+		syslog(LOG_WARNING, "event handler died, restarting it");
+		close(handler_fd);
+		handler_fd = -1;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Find the policy applying to @a event.
+ *
+ * @return The index of the policy, or NPOLICIES if there is none.
+ */
+static int policy_index(unsigned char event)
+{
+	int i;
+
+	for (i = 0; i < NPOLICIES; i++)
+		if (policies[i].event == event)
+			break;
+
+	return i;
+}
+
+
+/**
+ * Look for a slot to track a new child in.
+ *
+ * @return The free slot, or NULL if all are taken.
+ */
+static handler_slot *free_slot(void)
+{
+	for (int i = 0; i < HANDLER_SLOTS; i++)
+		if (handlers[i].pid == 0)
+			return &handlers[i];
+
+	return NULL;
+}
+
+
+/**
+ * Arm JOB_HANDLERS at the earliest handler deadline, if any.
+ */
+static void schedule_handler_timeouts(void)
+{
+	msec_t earliest = 0;
+
+	for (int i = 0; i < HANDLER_SLOTS; i++) {
+		msec_t deadline = handlers[i].deadline;
+		if (handlers[i].pid && deadline && (!earliest || deadline < earliest))
+			earliest = deadline;
+	}
+
+	if (earliest)
+		sched_at(&timers, JOB_HANDLERS, earliest);
+	else
+		sched_cancel(&timers, JOB_HANDLERS);
+}
+
+
+/**
+ * Start keeping track of child @a pid: a pidfd is registered with the main
+ * loop, so that we learn about its exit, and its time limit is scheduled.
+ *
+ * @param pid The process id of the child.
+ * @param policy The index of the policy of the event being handled, or -1
+ * for the persistent handler.
+ *
+ * @return false if there was no room left to track the child.
+ */
+static bool track_child(pid_t pid, int policy)
+{
+	handler_slot *slot = free_slot();
+
+	if (!slot) {
+		syslog(LOG_WARNING, "too many handlers, not tracking %d", pid);
+		return false;
+	}
+
+	/* An event without a policy is kept out of the per-policy counters */
+	if (policy >= NPOLICIES)
+		policy = -1;
+
+	slot->pid = pid;
+	slot->policy = policy;
+	slot->started = mono_usec();
+	slot->deadline = 0;
+	slot->terminated = false;
+
+	if (policy >= 0 && policy < NPOLICIES && policies[policy].timeout > 0)
+		slot->deadline = mono_now() + policies[policy].timeout * 1000;
+
+	/* Without pidfd support, SIGCHLD still tells us about the exit */
+	slot->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (slot->pidfd >= 0 && epoll_fd >= 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = slot->pidfd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slot->pidfd, &ev);
+	}
+
+	if (policy >= 0)
+		dispatcher.running++;
+
+	schedule_handler_timeouts();
+	return true;
+}
+
+
+/**
+ * Send @a signum to the child tracked in @a slot.
+ */
+static void signal_child(handler_slot *slot, int signum)
+{
+	if (slot->pidfd < 0 || syscall(SYS_pidfd_send_signal, slot->pidfd, signum, NULL, 0) < 0)
+		kill(slot->pid, signum);
+}
+
+
+/**
+ * Terminate the handlers that ran past their time limit: first politely,
+ * then, KILL_GRACE seconds later, for good.
+ */
+static void check_handler_timeouts(void)
+{
+	msec_t now = mono_now();
+
+	for (int i = 0; i < HANDLER_SLOTS; i++) {
+		handler_slot *slot = &handlers[i];
+
+		if (!slot->pid || !slot->deadline || slot->deadline > now)
+			continue;
+
+		if (!slot->terminated) {
+			const event_policy *policy = &policies[slot->policy];
+
+			syslog(LOG_WARNING, "handler for event %c still running after %d s, terminating it",
+			       policy->event, policy->timeout);
+			stats[slot->policy].killed++;
+			signal_child(slot, SIGTERM);
+			slot->terminated = true;
+			slot->deadline = now + KILL_GRACE * 1000;
+		} else {
+			signal_child(slot, SIGKILL);
+			slot->deadline = 0;
+		}
+	}
+
+	schedule_handler_timeouts();
+}
+
+
+/**
+ * Record the exit of the child tracked in @a slot and free the slot.
+ *
+ * @param slot The slot of the child.
+ * @param status The status returned by waitpid().
+ */
+static void finish_handler(handler_slot *slot, int status)
+{
+	usec_t elapsed = mono_usec() - slot->started;
+	msec_t duration = elapsed / 1000;
+	bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+	if (slot->policy >= 0) {
+		handler_stats *st = &stats[slot->policy];
+		unsigned char event = policies[slot->policy].event;
+
+		record_latency(slot->policy, STAGE_RUN, elapsed);
+
+		st->runs++;
+		st->total += duration;
+		if (duration > st->longest)
+			st->longest = duration;
+
+		if (failed) {
+			st->failures++;
+			if (WIFSIGNALED(status))
+				syslog(LOG_WARNING, "handler for event %c killed by signal %d after %lld ms",
+				       event, WTERMSIG(status), duration);
+			else
+				syslog(LOG_WARNING, "handler for event %c exited with status %d after %lld ms",
+				       event, WEXITSTATUS(status), duration);
+		}
+
+		dispatcher.running--;
+	} else if (slot->pid == handler_pid) {
+		/* The persistent handler is gone, the next event restarts it */
+		syslog(LOG_WARNING, "event handler exited after %lld ms", duration);
+		handler_pid = -1;
+		close(handler_fd);
+		handler_fd = -1;
+	}
+
+	if (slot->pidfd >= 0)
+		close(slot->pidfd);
+
+	slot->pid = 0;
+	slot->pidfd = -1;
+}
+
+
+/**
+ * Log how the handlers of each kind of event fared.
+ */
+static void log_handler_stats(void)
+{
+	for (int i = 0; i < NPOLICIES; i++) {
+		const handler_stats *st = &stats[i];
+
+		if (st->runs == 0)
+			continue;
+
+		syslog(LOG_INFO, "event %c: %lu handlers, %lu failed, %lu timed out, %lld ms average, %lld ms longest",
+		       policies[i].event, st->runs, st->failures, st->killed,
+		       st->total / (msec_t) st->runs, st->longest);
+	}
+}
+
+
+/**
+ * Run the handler for an event: the event script is spawned directly,
+ * without an intermediate shell, and left to run in the background.  In
+ * persistent mode, the event is instead handed over to the running
+ * instance of the script.
+ *
+ * @param event The event character.
+ * @param cmd2 The integer argument of the event.
+ * @param dispatched When the event was dispatched, for latency tracing.
+ */
+static void launch_event(unsigned char event, int cmd2, usec_t dispatched)
+{
+	char name[2] = { (char) event, '\0' };
+	char arg[ARG_LENGTH];
+	char *argv[] = { (char *) event_script, name, avr_device, arg, NULL };
+	pid_t pid;
+
+	snprintf(arg, sizeof(arg), "%d", cmd2);
+
+	int policy = policy_index(event);
+
+	/* Fall back to a script instance per event if need be */
+	if (persistent_handler && send_to_handler(event, arg) == 0) {
+		record_latency(policy, STAGE_START, mono_usec() - dispatched);
+		return;
+	}
+
+	if (spawn_script(argv, -1, &pid) == 0) {
+		record_latency(policy, STAGE_START, mono_usec() - dispatched);
+		track_child(pid, policy);
+	}
+}
+
+
+/**
+ * Start queued events while there are free handler slots.
+ */
+static void dispatch_run(void)
+{
+	while (dispatcher.head != dispatcher.tail && dispatcher.running < MAX_HANDLERS
+	       && free_slot()) {
+		size_t i = dispatcher.head++ % DISPATCH_QUEUE_SIZE;
+		launch_event(dispatcher.entries[i].event, dispatcher.entries[i].arg,
+			     dispatcher.entries[i].dispatched);
+	}
+
+	if (dispatcher.head == dispatcher.tail)
+		dispatcher.head = dispatcher.tail = 0;
+}
+
+
+/**
+ * Collect the exit status of finished children and hand their slots over
+ * to queued events.  Called when a pidfd becomes readable or on SIGCHLD.
+ */
+static void reap_children(void)
+{
+	pid_t pid;
+	int status;
+
+	/* Children started while every slot was taken are reaped too */
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (int i = 0; i < HANDLER_SLOTS; i++) {
+			if (handlers[i].pid == pid) {
+				finish_handler(&handlers[i], status);
+				break;
+			}
+		}
+	}
+
+	dispatch_run();
+	schedule_handler_timeouts();
+}
+
+
+/**
+ * Send commands to the AVR on behalf of an in-process handler.
+ */
+static int uart_send(const char *cmds, size_t len)
+{
+	uart_frame frame;
+
+	frame_reset(&frame);
+	for (size_t i = 0; i < len; i++)
+		frame_add(&frame, cmds[i]);
+
+	panel_forget();
+	return frame_flush(&frame);
+}
+
+
+/**
+ * Built-in handler echoing its parameter to the AVR, as the EventScript
+ * does with echo -n "YYYY" > $DEVICE.
+ */
+static int builtin_led(const avr_evtd_event *ev, const char *param)
+{
+	if (!param || !*param)
+		return -1;
+
+	return ev->send(param, strlen(param));
+}
+
+
+/**
+ * Built-in handler logging the event.
+ */
+static int builtin_syslog(const avr_evtd_event *ev, const char *param)
+{
+	syslog(LOG_INFO, "%s: event %c[%d]", param ? param : "avr-evtd", ev->event, ev->arg);
+	return 0;
+}
+
+
+/**
+ * Built-in handler powering the box off straight away.
+ */
+static int builtin_halt(const avr_evtd_event *, const char *)
+{
+	sync();
+	return reboot(RB_POWER_OFF);
+}
+
+
+/**
+ * Built-in handler rebooting the box straight away.
+ */
+static int builtin_reboot(const avr_evtd_event *, const char *)
+{
+	sync();
+	return reboot(RB_AUTOBOOT);
+}
+
+
+static const avr_evtd_plugin builtins[] = {
+	{ AVR_EVTD_PLUGIN_ABI, "led", builtin_led },
+	{ AVR_EVTD_PLUGIN_ABI, "syslog", builtin_syslog },
+	{ AVR_EVTD_PLUGIN_ABI, "halt", builtin_halt },
+	{ AVR_EVTD_PLUGIN_ABI, "reboot", builtin_reboot },
+};
+
+
+/**
+ * Load the plugin at @a path and check that we speak the same ABI.
+ *
+ * @return The plugin, or NULL on failure.
+ */
+static const avr_evtd_plugin *load_plugin(const char *path)
+{
+	void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+	if (!lib) {
+		fprintf(stderr, "%s\n", dlerror());
+		return NULL;
+	}
+
+	avr_evtd_plugin_init_fn init =
+		(avr_evtd_plugin_init_fn) dlsym(lib, AVR_EVTD_PLUGIN_INIT);
+	const avr_evtd_plugin *plugin = init ? init() : NULL;
+
+	if (!plugin || plugin->abi != AVR_EVTD_PLUGIN_ABI || !plugin->handle) {
+		fprintf(stderr, "%s: not a compatible avr-evtd plugin\n", path);
+		dlclose(lib);
+		return NULL;
+	}
+
+	return plugin;
+}
+
+
+/**
+ * Register the action described by @a spec, of the form
+ * EVENT:ACTION[:PARAM], where ACTION is the name of a built-in handler or
+ * the path of a plugin.  @a spec is split in place.
+ *
+ * @return 0 on success and -1 if @a spec is not valid.
+ */
+static int add_action(char *spec)
+{
+	if (nactions == MAX_ACTIONS || !spec[0] || spec[1] != ':' || !spec[2])
+		return -1;
+
+	event_action *action = &actions[nactions];
+	char *name = spec + 2;
+	char *param = strchr(name, ':');
+
+	if (param)
+		*param++ = '\0';
+
+	action->event = spec[0];
+	action->param = param;
+	action->plugin = NULL;
+
+	if (strchr(name, '/')) {
+		action->plugin = load_plugin(name);
+	} else {
+		for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+			if (strcmp(name, builtins[i].name) == 0)
+				action->plugin = &builtins[i];
+	}
+
+	if (!action->plugin)
+		return -1;
+
+	nactions++;
+	return 0;
+}
+
+
+/**
+ * Run the in-process actions registered for @a event, in the order they
+ * were given.
+ *
+ * @return true if there was at least one action and all of them handled
+ * the event, false if the event script is still to be run.
+ */
+static bool run_actions(unsigned char event, int arg)
+{
+	avr_evtd_event ev = { (char) event, avr_device, arg, uart_send };
+	bool handled = false;
+
+	for (int i = 0; i < nactions; i++) {
+		if (actions[i].event != event)
+			continue;
+
+		if (actions[i].plugin->handle(&ev, actions[i].param) != 0)
+			return false;
+
+		handled = true;
+	}
+
+	return handled;
+}
+
+
+/**
+ * Take a token from the bucket of policy @a i, if there is one left.
+ */
+static bool take_token(int i)
+{
+	const event_policy *policy = &policies[i];
+	msec_t now = mono_now();
+
+	if (refilled[i] == 0)
+		tokens[i] = policy->burst;
+	else
+		tokens[i] += (now - refilled[i]) * policy->per_minute / 60000.0;
+
+	if (tokens[i] > policy->burst)
+		tokens[i] = policy->burst;
+	refilled[i] = now;
+
+	if (tokens[i] < 1) {
+		if (!throttled[i])
+			syslog(LOG_INFO, "event %c rate limited", policy->event);
+		throttled[i] = true;
+		return false;
+	}
+
+	throttled[i] = false;
+	tokens[i] -= 1;
+	return true;
+}
+
+
+/**
+ * Execute event script handler with the commands passed as parameters.
+ * Unless the actions given with -a take care of it, the event goes through
+ * the dispatch queue, where repeated events are coalesced, rate limits are
+ * applied and the number of handlers running at once is capped.
+ *
+ * @param cmd1 First part of the command to the event script. A single character.
+ * @param cmd2 Second part of the command to the event script. An integer.
+ *
+ */
+static void exec_cmd(char cmd1, int cmd2)
+{
+	unsigned char event = cmd1;
+	int i = policy_index(event);
+	bool critical = i == NPOLICIES || policies[i].burst == 0;
+
+	usec_t dispatched = mono_usec();
+
+	/* Trace events coming straight from an AVR message */
+	if (current_msg) {
+		record_latency(i, STAGE_DECODE, current_msg->decoded - current_msg->received);
+		record_latency(i, STAGE_DISPATCH, dispatched - current_msg->decoded);
+	}
+
+	/* Handled within the daemon? */
+	if (run_actions(event, cmd2)) {
+		record_latency(i, STAGE_START, mono_usec() - dispatched);
+		return;
+	}
+
+	/* Critical events go straight out, unless we cannot keep track of
+	 * any more children */
+	if (critical && (persistent_handler || free_slot())) {
+		launch_event(event, cmd2, dispatched);
+		return;
+	}
+
+	if (!critical && policies[i].coalesce) {
+		for (size_t j = dispatcher.head; j != dispatcher.tail; j++) {
+			size_t k = j % DISPATCH_QUEUE_SIZE;
+			if (dispatcher.entries[k].event == event && dispatcher.entries[k].arg == cmd2)
+				return;
+		}
+	}
+
+	if (!critical && !take_token(i))
+		return;
+
+	if (dispatcher.tail - dispatcher.head >= DISPATCH_QUEUE_SIZE) {
+		syslog(LOG_WARNING, "event queue full, dropping event %c", event);
+		return;
+	}
+
+	size_t k = dispatcher.tail++ % DISPATCH_QUEUE_SIZE;
+	dispatcher.entries[k].event = event;
+	dispatcher.entries[k].arg = cmd2;
+	dispatcher.entries[k].dispatched = dispatched;
+
+	dispatch_run();
+}
+
+
+/**
+ * Abbreviated version of the executioner of the event script handler.
+ *
+ * @param cmd Command to be sent to the event script. It must consist of a
+ * single character.
+ *
+ */
+static void exec_simple_cmd(char cmd)
+{
+	exec_cmd(cmd, 0);
+}
+
+
+/**
+ * Take the hold times and windows of @a g from the configuration.  Only
+ * the power button has a hold time and, in EM-mode, the reset button a
+ * long one.
+ */
+static void configure_gestures(gesture_engine *g)
+{
+	g->press_gap = cfg->press_gap;
+	g->chord_gap = cfg->chord_gap;
+	g->hold[BUTTON_POWER] = cfg->hold_cycle * 1000;
+	g->long_hold[BUTTON_POWER] = 0;
+	g->hold[BUTTON_RESET] = 0;
+	g->long_hold[BUTTON_RESET] = in_em_mode ? EM_MODE_TIME * 1000 : 0;
+}
+
+
+/**
+ * Feed @a event to the timed shutdown and carry out its action.
+ *
+ * @return false if the event, a press, is not for the timed shutdown.
+ */
+static bool shutdown_run(shutdown_event event)
+{
+	switch (fsm_step(shutdown_table, &countdown.state, event)) {
+	case SA_NONE:
+		break;
+
+	case SA_PASS:
+		return false;
+
+	case SA_RESCHEDULE:
+		schedule_shutdown();
+		break;
+
+	case SA_WARN:
+		countdown.extensions = 0;
+
+		/* Inform the EventScript */
+		exec_cmd(FIVE_SHUTDOWN, shutdown_timer);
+
+		/* Re-validate out time wake-up; do not perform if in extra
+		 * time */
+		if (!countdown.extended)
+			set_avr_timer(1);
+
+		schedule_shutdown();
+		break;
+
+	case SA_EXTEND:
+		if (countdown.extensions < MAX_EXTENSIONS) {
+			shutdown_timer += FIVE_MINUTES;
+			countdown.extensions++;
+			countdown.extended = true;
+			schedule_shutdown();
+		}
+
+		exec_simple_cmd(POWER_RELEASE);
+
+		/* Watch for the end of the shutdown pause */
+		sched_in(&timers, JOB_PAUSE, SP_MONITOR_TIME);
+		break;
+
+	case SA_RESUME:
+		/* Inform the EventScript */
+		exec_cmd(FIVE_SHUTDOWN, shutdown_timer/60);
+		schedule_shutdown();
+		break;
+
+	case SA_SHUTDOWN:
+		exec_simple_cmd(TIMED_SHUTDOWN);
+		break;
+
+	case SA_CANCEL:
+		/* Work out the next shutdown, and let the press be taken
+		 * as usual */
+		set_avr_timer(1);
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Act on a sequence of presses of the power button.
+ *
+ * @param presses Number of presses.
+ */
+static void power_presses(int presses)
+{
+	/* Bring the countdown up to date */
+	if (cfg->timer_flag == 1)
+		update_shutdown_timer();
+
+	/* During the five minute warning and the pause that follows, each
+	 * press puts the shutdown off; it must not be taken for a reset */
+	if (shutdown_run(SD_PRESS)) {
+		for (int i = 1; i < presses; i++)
+			shutdown_run(SD_PRESS);
+	} else if (presses == 1)
+		exec_simple_cmd(POWER_RELEASE);
+	else if (presses == 2)
+		exec_simple_cmd(USER_RESET);
+	else
+		exec_cmd(TRIPLE_PRESS, 1);
+}
+
+
+/**
+ * Act on a gesture of the buttons.
+ *
+ * @param g The gesture.
+ */
+static void act_on_gesture(const gesture *g)
+{
+	switch (g->kind) {
+	case GESTURE_PRESS:
+		if (g->button == BUTTON_POWER)
+			power_presses(g->presses);
+		else if (g->presses == 1)
+			exec_simple_cmd(RESET_RELEASE);
+		else if (g->presses == 2) {
+			/* Launch our telnet daemon */
+			exec_cmd(SPECIAL_RESET, reset_presses);
+			reset_presses++;
+		} else
+			exec_cmd(TRIPLE_PRESS, 2);
+		break;
+
+		/* Power button held long enough to power down */
+	case GESTURE_HOLD:
+		if (g->button == BUTTON_POWER) {
+			/* Re-validate our time wake-up; do not perform if
+			 * in extra time */
+			if (!countdown.extended)
+				set_avr_timer(1);
+
+			exec_simple_cmd(USER_POWER_DOWN);
+		}
+		break;
+
+		/* Has user held the reset button long enough to request
+		 * EM-Mode? */
+	case GESTURE_LONG_HOLD:
+		if (g->button == BUTTON_RESET && in_em_mode) {
+			/* Send EM-Mode request to script.  The script handles
+			 * the flash device decoding and writes the HDD no-good
+			 * flag NGNGNG into the flash status.  It then flags a
+			 * reboot which causes the box to boot from ram-disk
+			 * backup to recover the HDD.
+			 */
+			exec_simple_cmd(EM_MODE);
+		}
+		break;
+
+	case GESTURE_CHORD:
+		exec_simple_cmd(CHORD_PRESS);
+		break;
+	}
+}
+
+
+/**
+ * Act on the gestures recognised by @a g and wake it up again at its next
+ * deadline.
+ *
+ * @param g The recogniser.
+ */
+static void run_gestures(gesture_engine *g)
+{
+	gesture gest;
+
+	while (gesture_next(g, &gest))
+		act_on_gesture(&gest);
+
+	msec_t at = gesture_deadline(g);
+
+	if (at)
+		sched_at(&timers, JOB_GESTURE, at);
+	else
+		sched_cancel(&timers, JOB_GESTURE);
+}
+
+
+/**
+ * Feed @a event to the fan machine and carry out its action.
+ *
+ * @param fan State of the fan, updated.
+ * @param event What happened.
+ */
+static void fan_run(fan_state *fan, fan_event event)
+{
+	fan_state was = *fan;
+
+	switch (fsm_step(fan_table, fan, event)) {
+	case FA_NONE:
+		break;
+
+	case FA_RECHECK:
+		/* Attempt to slow fan down again after 5 minutes */
+		sched_in(&timers, JOB_FAN, FIVE_MINUTES);
+		break;
+
+	case FA_REPORT:
+		/* Flag the EventScript */
+		exec_cmd(FAN_FAULT, fan_code[was]);
+
+		if (cfg->fan_fault_seize > 0)
+			sched_in(&timers, JOB_FAN, cfg->fan_fault_seize);
+		else
+			sched_cancel(&timers, JOB_FAN);
+		break;
+
+	case FA_GIVE_UP:
+		/* Run some user script on no fan restart message after
+		 * FAN_FAULT_SEIZE time */
+		exec_cmd(FAN_FAULT, 4);
+		break;
+
+	case FA_SLOW_DOWN:
+		avr_send<CMD_FAN_SLOW>();
+		sched_in(&timers, JOB_FAN, 2);
+		break;
+	}
+}
+
+
+/**
+ * Our main entry, decode requests and monitor activity
+ */
+static void avr_evtd_main(void)
+{
+	avr_decoder decoder;
+	avr_msg msg;
+	gesture_engine gestures;
+	int current_status = 0;
+	bool missing;
+	evloop loop;
+	struct epoll_event events[8];
+	char disk_full = 0;
+	job_id job;
+
+	decoder_reset(&decoder);
+	gesture_reset(&gestures);
+	configure_gestures(&gestures);
+
+	if (setup_evloop(&loop) < 0) {
+		syslog(LOG_ERR, "cannot set up event loop: %m");
+		return;
+	}
+
+	/* After startup, update the time within a few seconds as the user
+	 * may have pushed the refresh time out. */
+	timers.fd = loop.timer_fd;
+	sched_in(&timers, JOB_CONFIG, 2);
+	sched_in(&timers, JOB_DISK, 4);
+	sched_in(&timers, JOB_PING, 4);
+
+	if (probe_init(&prober) < 0)
+		syslog(LOG_ERR, "cannot set up disk prober: %m");
 
 	/* Loop whilst port is valid */
 	while (serialfd) {
-		timeout_poll.tv_usec = 0;
-		int res = refresh_rate;
-		/* After file change or startup, update the time within 20 secs as the
-		 * user may have pushed the refresh time out. */
-		if (check_state > 0) {
-			res = 2;
-		} else {
-			/* Change our timer to check for a power/reset request need a
-			 * faster poll rate here to see the double press event
-			 * properly. */
-			if (pushed_power || pushed_reset || first_time_flag > 1) {
-				timeout_poll.tv_usec = 250;
-				res = 0;
-				check_state = -2;
-				/* Hold off any configuration file updates */
-			}
+		/* Sleep until the earliest pending job is due */
+		sched_arm(&timers);
+
+		/* Wait for AVR message, signal or time-out */
+		int nevents = epoll_wait(loop.epfd, events, 8, -1);
+
+		bool input = false;
+
+		for (int i = 0; i < nevents; i++) {
+			int fd = events[i].data.fd;
+			uint64_t expirations;
+
+			if (fd == serialfd)
+				input = true;
+			else if (fd == loop.sigfd)
+				handle_signals(fd);
+			else if (fd == loop.timer_fd) {
+				/* Just acknowledge the expiry, the jobs are run below */
+				if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+					syslog(LOG_ERR, "timer read failed: %m");
+			} else if (fd == loop.clock_fd) {
+				if (clock_was_set(fd))
+					sched_at(&timers, JOB_CLOCK, mono_now());
+			} else if (fd == loop.config_fd) {
+				/* Let a burst of changes settle into one reload */
+				if (config_changed(fd))
+					sched_in(&timers, JOB_CONFIG, 1);
+			} else if (fd == prober.done_fd) {
+				/* Disk probe is complete, act on it straight away */
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					sched_at(&timers, JOB_DISK_RESULT, mono_now());
+			} else	/* pidfd of an exiting handler */
+				reap_children();
 		}
 
-		if (check_state != -2) {
-			/* Ensure we shutdown on the nail if the timer is enabled will
-			 * be off slightly as timer reads are different */
-			if (timer_flag == 1) {
-				if (shutdown_timer < res)
-					res = shutdown_timer;
+		/* catch input? */
+		if (input) {
+			/* Read AVR messages, all of them */
+			ssize_t res = decoder_fill(&decoder, serialfd);
+			decoder_run(&decoder);
+
+			while (decoder_next(&decoder, &msg)) {
+				current_msg = &msg;
+
+				switch (msg.type) {
+					/* power button release */
+				case MSG_POWER_RELEASE:
+					gesture_input(&gestures, BUTTON_POWER, false, msg.received / 1000);
+					run_gestures(&gestures);
+					break;
+
+					/* power button push */
+				case MSG_POWER_PUSH:
+					exec_simple_cmd(POWER_PRESS);
+					gesture_input(&gestures, BUTTON_POWER, true, msg.received / 1000);
+					run_gestures(&gestures);
+					break;
+
+					/* reset button release */
+				case MSG_RESET_RELEASE:
+					gesture_input(&gestures, BUTTON_RESET, false, msg.received / 1000);
+					run_gestures(&gestures);
+					break;
+
+					/* reset button push */
+				case MSG_RESET_PUSH:
+					exec_simple_cmd(RESET_PRESS);
+					gesture_input(&gestures, BUTTON_RESET, true, msg.received / 1000);
+					run_gestures(&gestures);
+					break;
+
+					/* Fan on high speed */
+				case MSG_FAN_HIGH:
+					fan_run(&panel.fan, FAN_EV_HIGH);
+					break;
+
+					/* Fan fault */
+				case MSG_FAN_FAULT:
+					fan_run(&panel.fan, FAN_EV_FAULT);
+					break;
+
+					/* Acknowledge */
+				case MSG_ACK:
+					break;
+
+					/* AVR halt requested */
+				case MSG_HALT:
+					close_serial();
+					exec_simple_cmd(AVR_HALT);
+					break;
+
+					/* AVR initialization complete */
+				case MSG_INIT_DONE:
+					break;
+				default:
+					syslog(LOG_INFO, "unknown message %X[%ld]", msg.raw, (long) res);
+					break;
+				}
 			}
 
-			/* If we have a fan failure report, then ping frequently */
-			if (fan_fault > 0)
-				res = fan_fault == 6 ? fan_fault_seize : 2;
-		}
+			current_msg = NULL;
+		}
+
+		/* A power/reset request is being watched for? */
+		bool scanning = gesture_busy(&gestures) || countdown.state == SD_PAUSED;
+
+		/* Run whatever is due */
+		while (sched_pop(&timers, mono_now(), &job)) {
+			switch (job) {
+				/* Configuration file changed or SIGHUP */
+			case JOB_CONFIG:
+				/* Hold off any configuration file updates during
+				 * power/reset scan */
+				if (scanning) {
+					sched_in(&timers, JOB_CONFIG, 2);
+					break;
+				}
+
+				check_timer(0);
+				configure_gestures(&gestures);
+				break;
+
+				/* Check the disk to see if full and output
+				 * appropriate AVR command? */
+			case JOB_DISK:
+				if (scanning) {
+					sched_in(&timers, JOB_DISK, 2);
+					break;
+				}
+
+				/* A probe stuck in statfs() is caught by the deadline
+				 * or by the next check, whichever comes first, and
+				 * only its own filesystem is then reported missing */
+				if (probe_start(&prober))
+					sched_in(&timers, JOB_DISK_RESULT, PROBE_DEADLINE);
+				else {
+					if (prober.busy.load(std::memory_order_acquire) && !prober.overdue) {
+						int i = prober.probing.load(std::memory_order_relaxed);
+						syslog(LOG_WARNING, "disk probe still running after %lld s, on %s",
+						       (long long) (mono_now() - prober.started) / 1000,
+						       i >= 0 ? prober.paths[i] : "?");
+						prober.overdue = true;
+					}
+					sched_at(&timers, JOB_DISK_RESULT, mono_now());
+				}
+
+				sched_in(&timers, JOB_DISK, disk_interval());
+				break;
+
+			case JOB_DISK_RESULT:
+				current_status = check_disk(&missing);
+
+				/* The configuration was read again while the probe
+				 * ran: the status stands until a probe of the new
+				 * filesystems, at once if the worker is free */
+				if (current_status < 0) {
+					current_status = disk_full;
+					if (!prober.busy.load(std::memory_order_acquire)) {
+						syslog(LOG_INFO, "disk probe for the previous configuration discarded");
+						sched_at(&timers, JOB_DISK, mono_now());
+					}
+					break;
+				}
+
+				if (current_status) {
+					/* Execute some user code on disk full */
+					if (first_warning) {
+						first_warning = cfg->pester_message;
+						exec_cmd(DISK_FULL, pct_used);
+					}
+				}
+
+				if (disk_full != current_status) {
+					if (!current_status) {
+						first_warning = 0;
+						exec_cmd(DISK_FULL, 0);
+					}
+
+					disk_full = current_status;
+				}
 
-		timeout_poll.tv_sec = res;
+				/* DISK LED flashes while a filesystem is missing */
+				panel_disk_led(missing ? LED_FLASHING : current_status ? LED_ON : LED_OFF);
 
-		FD_ZERO(&serialfd_set);
-		FD_SET(serialfd, &serialfd_set);
+				/* Pace the checks by how fast the disks fill up */
+				sched_in(&timers, JOB_DISK, disk_interval());
+				break;
 
-		/* Wait for AVR message or time-out? */
-		res = select(serialfd + 1, &serialfd_set, NULL, NULL, &timeout_poll);
+				/* Ping AVR */
+			case JOB_PING:
+				if (scanning) {
+					sched_in(&timers, JOB_PING, 2);
+					break;
+				}
 
-		time_t time_now = time(NULL);
+				/* One went out with the timer settings lately */
+				if (mono_now() < panel.kicked + cfg->refresh_rate * 1000L && panel.power_led == panel.keep_alive) {
+					panel.skipped++;
+					sched_at(&timers, JOB_PING, panel.kicked + cfg->refresh_rate * 1000L);
+					break;
+				}
 
-		/* catch input? */
-		if (res > 0) {
-			/* Read AVR message */
-			res = read(serialfd, buf, 16);
-			/* AVR command detected so force to ping only */
-			check_state = -2;
-
-			switch (buf[0]) {
-				/* power button release */
-			case 0x20:	/* ' ' */
-				if (pressed_power_flag == 0) {
-					cmd = POWER_RELEASE;
-
-					if ((time_now - power_press) <= HOLD_TIME && first_time_flag < 2) {
-						cmd = USER_RESET;
-					} else if (shutdown_timer < FIVE_MINUTES || first_time_flag > 1) {
-						if (first_time_flag == 0)
-							first_time_flag = 10;
-
-						shutdown_timer += FIVE_MINUTES;
-						first_time_flag--;
-						extraTime = 1;
-					}
+				panel_keep_alive();
+				sched_in(&timers, JOB_PING, cfg->refresh_rate);
+				break;
 
-					exec_simple_cmd(cmd);
-					power_press = time_now;
+				/* Shutdown timer event */
+			case JOB_SHUTDOWN:
+				if (scanning) {
+					sched_in(&timers, JOB_SHUTDOWN, 1);
+					break;
 				}
 
-				pushed_power = pressed_power_flag = 0;
+				update_shutdown_timer();
+
+				if (shutdown_timer <= 0)
+					shutdown_run(SD_TIME_UP);
+				else if (shutdown_timer < FIVE_MINUTES)
+					shutdown_run(SD_WARN_DUE);
+				else
+					shutdown_run(SD_DUE);
 				break;
 
-				/* power button push */
-			case 0x21:	/* '!' */
-				exec_simple_cmd(POWER_PRESS);
+				/* Check how long we have been operating with a fan
+				 * failure */
+			case JOB_FAN:
+				fan_run(&panel.fan, FAN_EV_TIMER);
+				break;
 
-				pressed_power_flag = 0;
-				pushed_power = 1;
+				/* A button was held down long enough, or no further
+				 * press came */
+			case JOB_GESTURE:
+				gesture_expire(&gestures, mono_now());
+				run_gestures(&gestures);
 				break;
 
-				/* reset button release */
-			case 0x22:	/* '"' */
-				if (pressed_reset_flag == 0) {
-					cmd = RESET_RELEASE;
-					res = 0;
-
-					/* Launch our telnet daemon */
-					if ((time_now - power_press) <= HOLD_TIME) {
-						cmd = SPECIAL_RESET;
-						res = reset_presses;
-						reset_presses++;
-					}
+				/* The shutdown pause function (if activated) is no
+				 * longer available, so ping the delayed time */
+			case JOB_PAUSE:
+				shutdown_run(SD_PAUSE_OVER);
+				break;
 
-					exec_cmd(cmd, res);
-					power_press = time_now;
+				/* Wall clock was set, either by the user or by an
+				 * NTP update: the shutdown and power-on times no
+				 * longer match the countdown, work them out again */
+			case JOB_CLOCK:
+				if (scanning) {
+					sched_in(&timers, JOB_CLOCK, 1);
+					break;
 				}
 
-				pushed_reset = pressed_reset_flag = 0;
+				check_timer(2);
 				break;
 
-				/* reset button push */
-			case 0x23:	/* '#' */
-				exec_simple_cmd(RESET_PRESS);
-
-				pressed_reset_flag = 0;
-				pushed_reset = 1;
+				/* Event handlers ran out of time */
+			case JOB_HANDLERS:
+				check_handler_timeouts();
 				break;
 
-				/* Fan on high speed */
-			case 0x24:	/* '$' */
-				fan_fault = 6;
-				fault_time = time_now;
+			case NJOBS:
 				break;
+			}
 
-				/* Fan fault */
-			case 0x25:	/* '%' */
-				/* Flag the EventScript */
-				exec_cmd(FAN_FAULT, fan_fault);
+			scanning = gesture_busy(&gestures) || countdown.state == SD_PAUSED;
+		}
+	}
+}
 
-				if (fan_fault_seize > 0) {
-					fan_fault = 2;
-					fault_time = time_now;
-				} else
-					fan_fault = -1;
 
-				break;
+/**
+ * Report errors. This function sends an error command to the UART.
+ *
+ * @param number An integer containing the number of the error to report.
+ */
+static void report_error(int number)
+{
+	exec_cmd(ERRORED, number);
+}
 
-				/* Acknowledge */
-			case 0x30:	/* '0' */
-				break;
 
-				/* AVR halt requested */
-			case 0x31:	/* '1' */
-				close_serial();
-				exec_simple_cmd(AVR_HALT);
-				break;
+/**
+ * Undo the octal escapes (\040 for a space and so on) used for blanks in
+ * the fields of mountinfo.
+ */
+static void unescape_mount_field(char *field)
+{
+	char *out = field;
+
+	while (*field) {
+		if (field[0] == '\\' && field[1] >= '0' && field[1] <= '3'
+		    && field[2] >= '0' && field[2] <= '7' && field[3] >= '0' && field[3] <= '7') {
+			*out++ = ((field[1] - '0') << 6) | ((field[2] - '0') << 3) | (field[3] - '0');
+			field += 4;
+		} else
+			*out++ = *field++;
+	}
 
-				/* AVR initialization complete */
-			case 0x33:	/* '3' */
-				break;
-			default:
-				syslog(LOG_INFO, "unknown message %X[%d]", buf[0], res);
+	*out = '\0';
+}
+
+
+/**
+ * Add the mount described by a line of mountinfo to @a table.  Only the
+ * device number and the mount point are kept; if a device is mounted more
+ * than once, the mount of its root directory is preferred.
+ */
+static void add_mount(mount_table *table, char *line)
+{
+	unsigned int major, minor;
+	char root[4096], mount_point[4096];
+
+	if (sscanf(line, "%*d %*d %u:%u %4095s %4095s", &major, &minor, root, mount_point) != 4)
+		return;
+
+	dev_t dev = makedev(major, minor);
+	unescape_mount_field(mount_point);
+
+	for (size_t i = 0; i < table->count; i++) {
+		if (table->entries[i].dev == dev) {
+			if (strcmp(root, "/") == 0) {
+				free(table->entries[i].mount_point);
+				table->entries[i].mount_point = strdup(mount_point);
+			}
+			return;
+		}
+	}
+
+	if (table->count == table->size) {
+		size_t size = table->size ? table->size * 2 : 32;
+		mount_entry *entries = (mount_entry *) realloc(table->entries, size * sizeof(*entries));
+
+		if (!entries)
+			return;
+
+		table->entries = entries;
+		table->size = size;
+	}
+
+	table->entries[table->count].dev = dev;
+	table->entries[table->count].mount_point = strdup(mount_point);
+	table->count++;
+}
+
+
+/**
+ * Bring @a table up to date.  The first call opens mountinfo and reads it;
+ * later calls read it again only if poll() reports a change of the mount
+ * table.  The file is parsed line by line as it is read, so there is no
+ * limit on its size.
+ *
+ * @return 0 on success and -1 if mountinfo could not be read.
+ */
+static int refresh_mounts(mount_table *table)
+{
+	char buff[4096];
+	size_t used = 0;
+	bool skip = false;	/* Rest of an overlong line */
+	ssize_t res;
+
+	if (table->fd < 0) {
+		table->fd = open(MOUNTINFO_LOCATION, O_RDONLY | O_CLOEXEC);
+		if (table->fd < 0)
+			return -1;
+	} else {
+		struct pollfd pfd = { table->fd, POLLPRI, 0 };
+
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLPRI | POLLERR)))
+			return 0;
+
+		lseek(table->fd, 0, SEEK_SET);
+	}
+
+	for (size_t i = 0; i < table->count; i++)
+		free(table->entries[i].mount_point);
+	table->count = 0;
+
+	while ((res = read(table->fd, buff + used, sizeof(buff) - 1 - used)) > 0) {
+		char *line = buff;
+		char *end;
+
+		used += res;
+		buff[used] = '\0';
+
+		while ((end = strchr(line, '\n'))) {
+			*end = '\0';
+			if (!skip)
+				add_mount(table, line);
+			skip = false;
+			line = end + 1;
+		}
+
+		used -= line - buff;
+		memmove(buff, line, used);
+
+		/* No end of line in a full buffer: the fields we want are at
+		 * the start, so use them and drop the rest of the line. */
+		if (used == sizeof(buff) - 1) {
+			if (!skip)
+				add_mount(table, buff);
+			skip = true;
+			used = 0;
+		}
+	}
+
+	return res < 0 ? -1 : 0;
+}
+
+
+/**
+ * Look up the mount point of device @a dev in @a table.
+ *
+ * @return The mount point, or NULL if the device is not mounted.
+ */
+static const char *find_mount(mount_table *table, dev_t dev)
+{
+	for (size_t i = 0; i < table->count; i++)
+		if (table->entries[i].dev == dev)
+			return table->entries[i].mount_point;
+
+	return NULL;
+}
+
+
+/**
+ * Find where the filesystem named @a name under /dev is mounted.  A block
+ * device (e.g. /dev/sda1) is looked up in the mount table, anything else
+ * there, such as the tmpfs on /dev/shm, is a mount point itself.  Names
+ * under /dev are safe to stat() from the main loop, as devtmpfs never
+ * blocks.
+ *
+ * @return The mount point, or NULL if the device is not mounted.
+ */
+static const char *device_mount(const char *name)
+{
+	struct stat st;
+
+	if (stat(name, &st) != 0)
+		return NULL;
+
+	if (!S_ISBLK(st.st_mode))
+		return name;
+
+	return find_mount(&mounts, st.st_rdev);
+}
+
+
+/**
+ * Add a filesystem to the monitored set.  @a spec is either a bare
+ * partition name (ROOT=sda1), a device (/dev/md0) or a mount point
+ * (/tmp), optionally followed by :BLOCK%[:INODE%[:HYSTERESIS]].
+ *
+ * @param c The configuration being read.
+ * @param spec The filesystem and its thresholds.
+ * @param legacy true for ROOT and WORK, which take no thresholds.
+ *
+ * @return NULL on success, or what is wrong with @a spec.
+ */
+static const char *add_monitor(config *c, span spec, bool legacy)
+{
+	if (c->ndisks == MAX_FILESYSTEMS || spec.len == 0)
+		return NULL;
+
+	fs_spec *fs = &c->disks[c->ndisks];
+
+	int block_pct = -1, inode_pct = 0, hysteresis = 0;
+	size_t len = 0;
+
+	while (len < spec.len && (legacy || spec.ptr[len] != ':'))
+		len++;
+
+	int n;
+	if (spec.ptr[0] == '/')
+		n = snprintf(fs->name, sizeof(fs->name), "%.*s", (int) len, spec.ptr);
+	else
+		n = snprintf(fs->name, sizeof(fs->name), "/dev/%.*s", (int) len, spec.ptr);
+
+	/* A truncated name would be some other path */
+	if (n < 0 || (size_t) n >= sizeof(fs->name))
+		return "filesystem name too long";
+
+	/* Thresholds, each one optional, and each a percentage */
+	int *limits[] = { &block_pct, &inode_pct, &hysteresis };
+	for (int i = 0; len < spec.len; i++) {
+		span rest = { spec.ptr + len + 1, spec.len - len - 1 };
+
+		if (i == 3)
+			return "too many thresholds, expected NAME[:BLOCK%[:INODE%[:HYSTERESIS]]]";
+
+		size_t used = span_int(rest, limits[i]);
+		if (used == 0 || *limits[i] < 0 || *limits[i] > 100)
+			return "invalid threshold, expected a percentage from 0 to 100";
+
+		len += 1 + used;
+		if (len < spec.len && spec.ptr[len] != ':')
+			return "invalid threshold, expected a percentage from 0 to 100";
+	}
+
+	fs->is_device = strncmp(fs->name, "/dev/", 5) == 0;
+	fs->block_pct = block_pct;
+	fs->inode_pct = inode_pct;
+	fs->hysteresis = hysteresis;
+
+	c->ndisks++;
+	return NULL;
+}
+
+
+/**
+ * Line the monitor states up with the disks of the configuration just
+ * swapped in, keeping what is known of the filesystems that were already
+ * monitored under @a old.
+ */
+static void sync_monitors(const config *old)
+{
+	fs_monitor kept[MAX_FILESYSTEMS];
+
+	for (int i = 0; i < cfg->ndisks; i++) {
+		memset(&kept[i], 0, sizeof(kept[i]));
+		kept[i].to_full = -1;
+
+		for (int j = 0; j < old->ndisks; j++)
+			if (strcmp(cfg->disks[i].name, old->disks[j].name) == 0) {
+				kept[i] = monitors[j];
 				break;
 			}
+	}
 
-			/* Get time for use later */
-			time(&idle);
-		} else {	/* Time-out event */
-			/* Check if button(s) are still held after holdcyle seconds */
-			if ((idle + hold_cycle) < time_now) {
-				/* Power down selected */
-				if (pushed_power == 1) {
-					/* Re-validate our time wake-up; do not perform if in extra time */
-					if (!extraTime)
-						set_avr_timer(1);
-
-					exec_simple_cmd(USER_POWER_DOWN);
-
-					pushed_power = 0;
-					pressed_power_flag = 1;
-				}
+	memcpy(monitors, kept, cfg->ndisks * sizeof(kept[0]));
+}
 
+
+/**
+ * Tell whether @a pct is over @a threshold, keeping a filesystem that was
+ * already full as such until it drops @a hysteresis points below.
+ */
+static bool over_threshold(int pct, int threshold, int hysteresis, bool full)
+{
+	if (threshold <= 0)
+		return false;
+
+	return full ? pct > threshold - hysteresis : pct > threshold;
+}
+
+
+/**
+ * Probe the filesystems of the current request, publishing each result as
+ * soon as statfs() returns.
+ */
+static void probe_run(disk_prober *p)
+{
+	struct statfs mountfs;
+
+	for (int i = 0; i < p->count; i++) {
+		probe_result r = { p->gen, 0, 0, 0 };
+		unsigned int free_ppm = 0;
+
+		p->probing.store(i, std::memory_order_relaxed);
+		if (p->paths[i][0] && statfs(p->paths[i], &mountfs) == 0) {
+			r.ok = 1;
+			if (mountfs.f_blocks > 0) {
+				r.block_pct = 100 - ((100.0 * mountfs.f_bavail) / mountfs.f_blocks);
+				free_ppm = (1e6 * mountfs.f_bavail) / mountfs.f_blocks;
 			}
+			if (mountfs.f_files > 0)
+				r.inode_pct = 100 - ((100.0 * mountfs.f_ffree) / mountfs.f_files);
+		}
+
+		p->free_ppm[i].store(free_ppm, std::memory_order_relaxed);
+		p->results[i].store(r, std::memory_order_release);
+	}
+
+	p->probing.store(-1, std::memory_order_relaxed);
+}
+
+
+/**
+ * Disk worker thread: wait for a request, probe and report back.
+ */
+static void *probe_worker(void *arg)
+{
+	disk_prober *p = (disk_prober *) arg;
+	uint64_t n = 1;
+
+	for (;;) {
+		if (read(p->request_fd, &n, sizeof(n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (p->busy.load(std::memory_order_acquire))
+			probe_run(p);
+
+		p->busy.store(false, std::memory_order_release);
+		n = 1;
+		if (write(p->done_fd, &n, sizeof(n)) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Set up the disk prober and start its worker thread.  Should the thread
+ * not start, probes are run inline instead.
+ *
+ * @return 0 on success and -1 if the prober cannot be used at all.
+ */
+static int probe_init(disk_prober *p)
+{
+	struct epoll_event ev;
+
+	p->threaded = false;
+	p->busy.store(false);
+	p->probing.store(-1);
+	p->gen = 0;
+	p->config_gen = p->prev_config_gen = 0;
+	p->overdue = false;
+	p->count = 0;
+
+	p->request_fd = eventfd(0, EFD_CLOEXEC);
+	p->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (p->request_fd < 0 || p->done_fd < 0)
+		return -1;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = p->done_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->done_fd, &ev) < 0)
+		return -1;
+
+	/* The worker inherits the blocked signal mask, so signals are only
+	 * ever seen through the signalfd of the main loop. */
+	int res = pthread_create(&p->thread, NULL, probe_worker, p);
+	if (res != 0)
+		syslog(LOG_ERR, "cannot start disk worker: %s", strerror(res));
+	else
+		p->threaded = true;
+
+	return 0;
+}
+
+
+/**
+ * Post a probe of the monitored filesystems.  Mount points are looked up
+ * here, as /proc/self/mountinfo never blocks on storage.
+ *
+ * @return true if a probe was started, false if the previous one is still
+ * running or disk checks are off.
+ */
+static bool probe_start(disk_prober *p)
+{
+	uint64_t n = 1;
+
+	if (cfg->max_pct <= 0 || cfg->ndisks == 0)
+		return false;
+
+	if (p->busy.load(std::memory_order_acquire))
+		return false;
+
+	bool mounted = refresh_mounts(&mounts) == 0;
+
+	p->gen++;
+	p->prev_config_gen = p->config_gen;
+	p->config_gen = cfg->generation;
+	p->started = mono_now();
+	p->overdue = false;
+	p->count = cfg->ndisks;
+	for (int i = 0; i < p->count; i++) {
+		const fs_spec *fs = &cfg->disks[i];
+		const char *mount_point = fs->is_device ? device_mount(fs->name) : fs->name;
+
+		if (!mounted || !mount_point)
+			mount_point = "";
+		snprintf(p->paths[i], sizeof(p->paths[i]), "%s", mount_point);
+	}
+
+	p->busy.store(true, std::memory_order_release);
+
+	if (!p->threaded) {
+		probe_run(p);
+		p->busy.store(false, std::memory_order_release);
+		return write(p->done_fd, &n, sizeof(n)) == sizeof(n);
+	}
+
+	return write(p->request_fd, &n, sizeof(n)) == sizeof(n);
+}
+
+
+/**
+ * Add a free space reading to the ring of @a fs and estimate from it how
+ * fast the filesystem fills up, by least squares, and how long it has
+ * left before it goes over @a threshold percent.
+ */
+static void predict_fill(fs_monitor *fs, msec_t now, unsigned int free_ppm, int threshold)
+{
+	fill_sample *ring = fs->samples;
+
+	ring[fs->next_sample].when = now;
+	ring[fs->next_sample].free_ppm = free_ppm;
+	fs->next_sample = (fs->next_sample + 1) % FILL_SAMPLES;
+	if (fs->nsamples < FILL_SAMPLES)
+		fs->nsamples++;
+
+	fs->fill_rate = 0;
+	fs->to_full = -1;
+
+	if (fs->nsamples < 3)
+		return;
+
+	/* Times in seconds from the oldest reading kept */
+	msec_t origin = ring[fs->nsamples < FILL_SAMPLES ? 0 : fs->next_sample].when;
+	double st = 0, sf = 0, stt = 0, stf = 0;
+	int n = fs->nsamples;
+
+	for (int i = 0; i < n; i++) {
+		double t = (ring[i].when - origin) / 1000.0;
+		st += t;
+		sf += ring[i].free_ppm;
+		stt += t * t;
+		stf += t * ring[i].free_ppm;
+	}
+
+	double d = n * stt - st * st;
+	if (d <= 0)
+		return;
+
+	fs->fill_rate = -(n * stf - st * sf) / d;
+
+	/* Under a megabyte a day per terabyte is standing still */
+	if (fs->fill_rate < 1e-5)
+		return;
+
+	double free_at_threshold = (100 - threshold) * 10000.0;
+	fs->to_full = free_ppm > free_at_threshold
+		? (free_ppm - free_at_threshold) / fs->fill_rate : 0;
+}
+
+
+/**
+ * Raise DISK_FILLING once a filesystem is predicted to be full within
+ * FILLWARN minutes, with the minutes left as argument, and again with 0
+ * once it has calmed down.
+ */
+static void warn_filling(fs_monitor *fs)
+{
+	long warning = cfg->fill_warning * 60L;
+	bool soon = cfg->fill_warning > 0 && !fs->full &&
+		fs->to_full >= 0 && fs->to_full <= warning;
+
+	if (soon && !fs->filling) {
+		fs->filling = true;
+		exec_cmd(DISK_FILLING, fs->to_full / 60 + 1);
+	} else if (fs->filling && !soon &&
+		   (fs->full || fs->to_full < 0 || fs->to_full > 2 * warning)) {
+		/* Full is reported by DISK_FULL on its own */
+		fs->filling = false;
+		if (!fs->full)
+			exec_cmd(DISK_FILLING, 0);
+	}
+}
+
+
+/**
+ * Work out when the disks should be checked next: sooner the closer a
+ * filesystem is to filling up, and less often while none of them change.
+ *
+ * @return The delay in seconds.
+ */
+static long disk_interval(void)
+{
+	long interval = cfg->refresh_rate;
+	bool idle = cfg->ndisks > 0;
+
+	for (int i = 0; i < cfg->ndisks; i++) {
+		fs_monitor *fs = &monitors[i];
+
+		/* A full disk is already reported, no need to hurry */
+		if (!fs->full && fs->to_full >= 0 && fs->to_full / 10 < interval)
+			interval = fs->to_full / 10;
+
+		if (fs->nsamples < FILL_SAMPLES || fs->fill_rate != 0)
+			idle = false;
+		else
+			for (int j = 1; j < FILL_SAMPLES; j++)
+				if (fs->samples[j].free_ppm != fs->samples[0].free_ppm)
+					idle = false;
+	}
+
+	if (idle)
+		return cfg->refresh_rate * IDLE_DISK_FACTOR;
+
+	return interval < MIN_DISK_INTERVAL ? MIN_DISK_INTERVAL : interval;
+}
+
+
+/**
+ * Check that the filesystems are intact and we have at least DISKCHECK%
+ * (or their own thresholds) spare capacity, from the results of the last
+ * probe.  A filesystem that has not answered the probe yet is taken as
+ * missing, and the result is made up from the others; those still queued
+ * behind it keep their previous reading.  pct_used is set
+ * to the usage of the worst offender.
+ *
+ * @param missing Set if a filesystem is missing.
+ *
+ * @return 1 if a filesystem is full, 0 otherwise, and -1 if the probe was
+ * made for the filesystems of an earlier configuration.
+ *
+ * NOTE: DISK FULL LED may flash during a disk check as /dev/hda3 mount
+ * check will not be available, this is not an error and light will
+ * extinguish once volume has been located
+ */
+static int check_disk(bool *missing)
+{
+	int any_full = 0;
+	int worst = 0;
+
+	pct_used = 0;
+	*missing = false;
+
+	/* Only test when DISKCHECK is enabled and partitions are defined */
+	if (cfg->max_pct <= 0 || cfg->ndisks == 0)
+		return 0;
+
+	/* Results are matched to the monitors by position, which only holds
+	 * for the configuration the probe was made for */
+	if (prober.config_gen != cfg->generation)
+		return -1;
+
+	/* Entry the worker is stuck on, if any */
+	int hung = prober.busy.load(std::memory_order_acquire) ?
+		prober.probing.load(std::memory_order_relaxed) : -1;
+
+	/* FIXME: Is this kind of test correct for any kind of filesystem? */
+	for (int i = 0; i < cfg->ndisks; i++) {
+		const fs_spec *spec = &cfg->disks[i];
+		fs_monitor *fs = &monitors[i];
+		probe_result r = prober.results[i].load(std::memory_order_acquire);
+
+		/* Not reached yet, so one hung mount does not take the rest */
+		bool queued = hung >= 0 && i > hung &&
+			r.gen == (unsigned char) (prober.gen - 1) &&
+			prober.prev_config_gen == cfg->generation;
+
+		if ((r.gen != prober.gen && !queued) || !r.ok) {
+			if (!fs->missing)
+				syslog(LOG_WARNING, "%s is missing", spec->name);
+			fs->missing = true;
+			*missing = true;
+			continue;
+		}
+
+		fs->missing = false;
+
+		int block_pct = r.block_pct, inode_pct = r.inode_pct;
+
+		int threshold = spec->block_pct < 0 ? cfg->max_pct : spec->block_pct;
+
+		/* Each probe is sampled once, however often it is looked at */
+		if (fs->sampled != r.gen || fs->nsamples == 0) {
+			fs->sampled = r.gen;
+			predict_fill(fs, mono_now(), prober.free_ppm[i].load(std::memory_order_relaxed), threshold);
+		}
+
+		/* Each check keeps its own hysteresis */
+		bool block_full = over_threshold(block_pct, threshold, spec->hysteresis, fs->block_full);
+		bool inode_full = over_threshold(inode_pct, spec->inode_pct, spec->hysteresis, fs->inode_full);
+
+		fs->block_full = block_full;
+		fs->inode_full = inode_full;
+		fs->full = block_full || inode_full;
+		warn_filling(fs);
+
+		/* Report the figure that got the filesystem flagged */
+		int pct = block_pct;
+		if (inode_full && (!block_full || inode_pct > block_pct))
+			pct = inode_pct;
+
+		if (fs->full) {
+			any_full = 1;
+			if (pct > worst)
+				worst = pct;
+		}
+
+		if (pct > pct_used)
+			pct_used = pct;
+	}
 
-			/* Has user held the reset button long enough to request EM-Mode? */
-			if ((idle + EM_MODE_TIME) < time_now) {
-				if (pushed_reset == 1 && in_em_mode) {
-					/* Send EM-Mode request to script.  The script handles the
-					 * flash device decoding and writes the HDD no-good flag
-					 * NGNGNG into the flash status.  It then flags a reboot
-					 * which causes the box to boot from ram-disk backup to
-					 * recover the HDD.
-					 */
-					exec_simple_cmd(EM_MODE);
-
-					pushed_reset = 0;
-					pressed_reset_flag = 1;
-				}
-			}
+	if (any_full)
+		pct_used = worst;
 
-			/* Skip this processing during power/reset scan */
-			if (!pushed_reset && !pushed_power && first_time_flag < 2) {
-				/* shutdown timer event? */
-				if (timer_flag == 1) {
-					/* Decrement our powerdown timer */
-					if (shutdown_timer > 0) {
-						time_diff = (time_now - last_shutdown_ping);
-
-						/* If time difference is more than a minute,
-						 * force a re-calculation of shutdown time */
-						if (refresh_rate + 60 > labs(time_diff)) {
-							shutdown_timer -= time_diff;
-
-							/* Within five minutes of shutdown? */
-							if (shutdown_timer < FIVE_MINUTES) {
-								if (first_time_flag) {
-									first_time_flag = 0;
-
-									/* Inform the EventScript */
-									exec_cmd(FIVE_SHUTDOWN, shutdown_timer);
-
-									/* Re-validate out time wake-up; do not
-									 * perform if in extra time */
-									if (!extraTime)
-										set_avr_timer(1);
-								}
-							}
-						}
-						/* Large clock drift, either user set time
-						 * or an ntp update, handle accordingly. */
-						else {
-							check_timer(2);
-						}
-					} else {
-						/* Prevent re-entry and execute command */
-						pushed_power = pressed_reset_flag = 2;
-						exec_simple_cmd(TIMED_SHUTDOWN);
-					}
-				}
+	return any_full;
+}
 
-				/* Keep track of shutdown time remaining */
-				last_shutdown_ping = time(NULL);
 
-				/* Split loading, handle disk checks
-				 * over a number of cycles, reduce CPU hog */
-				switch (check_state) {
-					/* Kick state machine */
-				case 0:
-					check_state = 1;
-					break;
+/**
+ * Compare @a s with @a word, ignoring case.
+ */
+static bool span_is(span s, const char *word)
+{
+	return strlen(word) == s.len && strncasecmp(s.ptr, word, s.len) == 0;
+}
 
-					/* Check for timer change through configuration file */
-				case 1:
-					check_timer(0);
-					check_state = 2;
-					break;
 
-					/* Check the disk and ping AVR accordingly */
-				case -2:
+/**
+ * Read a decimal number, with an optional minus sign, from the start of
+ * @a s.
+ *
+ * @return The number of characters used, 0 if there is no number (and
+ * @a value is left alone).
+ */
+static size_t span_int(span s, int *value)
+{
+	size_t i = 0;
+	bool negative = false;
+	long n = 0;
 
-					/* Check the disk to see if full and output appropriate
-					 * AVR command? */
-				case 2:
-					cmd = keep_alive;
+	if (s.len > 0 && s.ptr[0] == '-') {
+		negative = true;
+		i++;
+	}
 
-					if ((current_status = check_disk())) {
-						/* Execute some user code on disk full */
-						if (first_warning) {
-							first_warning = pester_message;
-							exec_cmd(DISK_FULL, pct_used);
-						}
-					}
+	size_t digits = i;
+	while (i < s.len && s.ptr[i] >= '0' && s.ptr[i] <= '9' && n < 100000)
+		n = n * 10 + (s.ptr[i++] - '0');
 
-					/* Only update DISK LED on disk full change */
-					if (disk_full != current_status) {
-						/* LED status */
-						cmd = 0x56;	/* 'V' */
-						if (current_status)
-							cmd++;
-						else {
-							first_warning = 0;
-							exec_cmd(DISK_FULL, 0);
-						}
-
-						disk_full = current_status;
-					}
+	if (i == digits)
+		return 0;
 
-					/* Ping AVR */
-					write_to_uart(cmd);
+	*value = negative ? -n : n;
+	return i;
+}
 
-					check_state = 3;
-					break;
 
-					/* Wait for next refresh kick */
-				case 3:
-					check_state = 0;
-					break;
-				}
-			}
+/**
+ * Read a time of day, HH:MM, from @a s.
+ *
+ * @return The time in minutes from midnight, or -1 if @a s is not a valid
+ * time.
+ */
+static long span_time(span s)
+{
+	int hour, minutes;
+	size_t used = span_int(s, &hour);
 
-			/* Try and catch spurious fan fault messages */
-			switch (fan_fault) {
-			case -1:
-				break;
-			case 1:
-				fan_fault = 0;
-				break;
-				/* Check how long we have been operating with a fan failure */
-			case 2:
-			case 3:
-			case 4:
-				if ((fault_time + fan_fault_seize) < time_now) {
-					/* Run some user script on no fan restart message after
-					 * FAN_FAULT_SEIZE time */
-					exec_cmd(FAN_FAULT, 4);
-					fan_fault = 5;
-				}
+	if (used == 0 || hour < 0 || used >= s.len || s.ptr[used] != ':')
+		return -1;
 
-				break;
-				/* Fan sped up message received */
-			case 6:
-				/* Attempt to slow fan down again after 5 minutes */
-				if ((fault_time + FIVE_MINUTES) < time_now) {
-					write_to_uart(0x5C);	/* '\\' */
-					fan_fault = 1;
-				}
+	span rest = { s.ptr + used + 1, s.len - used - 1 };
+	if (span_int(rest, &minutes) != rest.len || minutes < 0)
+		return -1;
 
-				break;
-			}
+	/* 24:00 is accepted as the end of the day */
+	if (hour > 24 || minutes > 59)
+		return -1;
 
-			/* Check that the shutdown pause function (if activated) is still
-			 * available, no then ping the delayed time */
-			if ((power_press + SP_MONITOR_TIME) < time_now && first_time_flag > 1) {
-				/* Inform the EventScript */
-				exec_cmd(FIVE_SHUTDOWN, shutdown_timer/60);
-				first_time_flag = 1;
-				power_press = 0;
-			}
-		}
-	}
+	return (hour * 60) + minutes;
 }
 
 
 /**
- * Report errors. This function sends an error command to the UART.
+ * Take the next token of a configuration line, that is everything up to
+ * the first of @a stops or the end of the line, with blanks trimmed.
  *
- * @param number An integer containing the number of the error to report.
+ * @param pos Start of the token; left at the stop character on return.
+ * @param end End of the line.
  */
-static void report_error(int number)
+static span next_token(const char **pos, const char *end, const char *stops)
 {
-	exec_cmd(ERRORED, number);
+	const char *start = *pos;
+
+	while (*pos < end && !strchr(stops, **pos))
+		(*pos)++;
+
+	const char *stop = *pos;
+	while (start < stop && (*start == ' ' || *start == '\t'))
+		start++;
+	while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t' || stop[-1] == '\r'))
+		stop--;
+
+	span token = { start, (size_t) (stop - start) };
+	return token;
 }
 
 
 /**
- * Check that the filesystem is intact and we have at least DISKCHECK%
- * spare capacity.
+ * Turn a day or range of days, such as MON or MON-THR, into day numbers.
  *
- * NOTE: DISK FULL LED may flash during a disk check as /dev/hda3 mount
- * check will not be available, this is not an error and light will
- * extinguish once volume has been located
+ * @return true if @a s names a day or a range of days, @a first and
+ * @a last being left alone otherwise.
  */
-static char check_disk(void)
+static bool parse_days(span s, const char *const days[], int *first, int *last)
 {
-	static const int PART_NAME_SIZE = 16;
-	static const int BUFF_SIZE = 4096;
+	span from = { s.ptr, 3 };
+	span to = from;
+	int from_day = -1, to_day = -1;
+
+	if (s.len == 7 && s.ptr[3] == '-')
+		to.ptr = s.ptr + 4;
+	else if (s.len != 3)
+		return false;
+
+	for (int i = 0; i < 7; i++) {
+		if (span_is(from, days[i]))
+			from_day = i;
+		if (span_is(to, days[i]))
+			to_day = i;
+	}
 
-	static char FirstTime = 0;
-	static char root_mountpt[PART_NAME_SIZE];
-	static char work_mountpt[PART_NAME_SIZE];
-	struct statfs mountfs;
+	if (from_day < 0 || to_day < 0)
+		return false;
 
-	int pct_root = 0;	/* percentage of the root fs that is used */
-	int pct_work = 0;	/* percentage of the work fs that is used */
+	*first = from_day;
+	*last = to_day;
+	return true;
+}
 
-	char buff[BUFF_SIZE];
 
-	enum { UNSET = -1, ROOT, WORK } device_type;
+/**
+ * Add an event at @a time (minutes from midnight) of @a day to @a week.
+ * The storage grows by doubling, so entries are not allocated one by one.
+ */
+static void week_add(schedule *week, int day, long time)
+{
+	if (week->count == week->size) {
+		int size = week->size ? week->size * 2 : 16;
+		long *when = (long *) realloc(week->when, size * sizeof(*when));
+
+		if (!when)
+			return;
+		week->when = when;
+		week->size = size;
+	}
 
-	if (FirstTime < diskcheck_number) {	/* first, determine paths from mtab */
-		FirstTime = 0;
+	/* 24:00 on Saturday is the very start of the week */
+	week->when[week->count++] = (day * TWENTYFOURHR + time) % ONE_WEEK;
+}
 
-		int file = open("/etc/mtab", O_RDONLY);
-		if (file < 0)
-			goto err_not_avail;
 
-		if (read(file, buff, BUFF_SIZE - 1) > 0) {
-			char *pos = strtok(buff, " \n");
-			for (int i = 0; i < 60; i++) {
-				device_type = UNSET;
+/**
+ * qsort() comparison of two minutes of the week.
+ */
+static int compare_minutes(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
 
-				if (strcasecmp(pos, root_device) == 0)
-					device_type = ROOT;
-				else if (strcasecmp(pos, work_device) == 0)
-					device_type = WORK;
+	return (x > y) - (x < y);
+}
 
-				pos = strtok(NULL, " \n");
-				if (!pos)
-					break;
 
-				/* Increment firsttime check, with bad restarts,
-				 * /dev/hda3 may not be mounted yet (running a disk check) */
-				switch (device_type) {
-				case ROOT:
-					sprintf(root_mountpt, "%s", pos);
-					break;
-				case WORK:
-					sprintf(work_mountpt, "%s", pos);
-					break;
-				default:
-					break;
-				}
-				FirstTime++;
-			}
-		}
-		close(file);
-	}
+/**
+ * Sort the events of @a week and drop duplicates, whatever order they
+ * were given in.
+ */
+static void week_compile(schedule *week)
+{
+	int n = 0;
 
-	/* Only test when DISKCHECK is enabled and partitions are defined */
-	/* FIXME: Is this kind of test correct for any kind of filesystem? */
-	if (max_pct > 0 && diskcheck_number > 0) {
-		if (diskcheck_number == FirstTime) {
-			if (strlen(root_mountpt) > 0) {
-				if (statfs(root_mountpt, &mountfs) == -1)
-					goto err_not_avail;
-				pct_root = 100 - ((100.0 * mountfs.f_bavail) / mountfs.f_blocks);
-			}
+	qsort(week->when, week->count, sizeof(*week->when), compare_minutes);
 
-			if (strlen(work_mountpt) > 0) {
-				if (statfs(work_mountpt, &mountfs) == -1)
-					goto err_not_avail;
-				pct_work = 100 - ((100.0 * mountfs.f_bavail) / mountfs.f_blocks);
-			}
-		}
-	}
+	for (int i = 0; i < week->count; i++)
+		if (n == 0 || week->when[i] != week->when[n - 1])
+			week->when[n++] = week->when[i];
 
-	pct_used = (pct_root > pct_work) ? pct_root : pct_work;
-	return (pct_used > max_pct);
+	week->count = n;
+}
 
-err_not_avail:
-	write_to_uart(0x59); /* 'Y' */
-	return 0;
+
+/**
+ * Log a configuration file error.
+ *
+ * @param line Line number, from 1.
+ * @param at Where on the line the error is.
+ * @param line_start Start of the line.
+ */
+static void config_error(int line, const char *at, const char *line_start, const char *what)
+{
+	syslog(LOG_ERR, "%s:%d:%d: %s", config_file, line,
+	       (int) (at - line_start) + 1, what);
 }
 
 
 /**
- * Parse configuration file.
+ * Parse configuration file.  The file is made of lines of
+ * KEYWORD=VALUE settings, several of which may share a line separated by
+ * commas.  A day or range of days followed by '=' sets the days the
+ * ON and OFF macros that follow apply to, on that line and the next ones.
+ * Keywords not known here are left to the event script, which sources
+ * the file as shell: anything else on a line, such as shell code, is
+ * logged and skipped.  Only a bad value of a known keyword makes the file
+ * invalid.
+ *
+ * @param content The contents of the config file (usually,
+ * /etc/default/avr-evtd), not necessarily NUL-terminated.
+ * @param length Size of @a content.
+ * @param c The configuration to fill in, from the defaults.
  *
- * @param content A string with the contents of the config file
- * (usually, /etc/default/avr-evtd).
+ * @return true if the whole file is valid.
  */
-static void parse_config(char *content)
+static bool parse_config(const char *content, size_t length, config *c)
 {
 	const char *command[] = {
 		"TIMER",
@@ -792,11 +4383,14 @@ static void parse_config(char *content)
 		"DISKCHECK",
 		"REFRESH",
 		"HOLD",
-		"SUN", "MON", "TUE", "WED", "THR", "FRI", "SAT",
+		"PRESSGAP",
+		"CHORDGAP",
 		"DISKNAG",
+		"FILLWARN",
 		"FANSTOP",
 		"ROOT",
-		"WORK"
+		"WORK",
+		"DISK"
 	};
 
 	enum cmd_code_t {
@@ -809,407 +4403,482 @@ static void parse_config(char *content)
 		DISKCHECK,
 		REFRESH,
 		HOLD,
-		SUN, MON, TUE, WED, THR, FRI, SAT,
+		PRESSGAP,
+		CHORDGAP,
 		DISKNAG,
+		FILLWARN,
 		FANSTOP,
 		ROOT,
-		WORK
+		WORK,
+		DISK
 	};
 
-
+	const char *const days[] = { "SUN", "MON", "TUE", "WED", "THR", "FRI", "SAT" };
 
 #define NCOMMANDS		(sizeof(command) / sizeof(const char*))
 
-	char *pos;
-	char *last;		/* Used by strtok_r to point to current token */
-	int j;
-	int hour;
-	int minutes;
-	int group = 0;
-	int last_group = 0;
+	const char *end = content + length;
+	int line = 0;
 	int first_day = -1;
-	int process_day = -1;
-	event *pTimer;
-	event *pOff;
-	event *pOn;
+	int final_day = -1;
+	bool valid = true;
+	bool timer_error = false;
 
-	/* Parse our time requests */
-	pos = strtok_r(content, ",=\n", &last);
+	/* Establish some defaults */
+	config_defaults(c);
 
-	/* Destroy the macro timer objects, if any */
-	destroy_timer(off_timer);
-	destroy_timer(on_timer);
 
-	/* Now create our timer objects for on and off events */
-	pOn = on_timer = new event;
-	pOff = off_timer = new event;
+	for (const char *line_start = content; line_start < end; ) {
+		const char *eol = (const char *) memchr(line_start, '\n', end - line_start);
+		const char *pos = line_start;
 
-	/* Establish some defaults */
-	pester_message = 0;
-	timer_flag = 0;
-	refresh_rate = 40;
-	hold_cycle = 3;
-	diskcheck_number = 0;
-
-	/* To prevent looping */
-	for (int i = 0; i < 200; i++) {
-		int cmd = -1;
-
-		if (pos[0] != COMMENT_PREFIX) {
-			/* Could return groups, say MON-THR, need to
-			 * strip '-' out */
-			if (pos[3] == '-') {
-				*(last - 1) = '=';	/* Plug the '0' with token parameter  */
-				group = 1;
-				last -= 8;
-				pos = strtok_r(NULL, "-", &last);
-			}
+		if (!eol)
+			eol = end;
+		line++;
 
-			/* Locate our expected commands */
-			for (cmd = 0; cmd < (int) NCOMMANDS; cmd++)
-				if (strcasecmp(pos, command[cmd]) == 0)
-					break;
+		while (pos < eol) {
+			span key = next_token(&pos, eol, "=,#");
 
-			pos = strtok_r(NULL, ",=\n", &last);
-		} else {
-			pos = strtok_r(NULL, "\n", &last);
-
-			/* After the first remark we have ignored, make sure
-			 * we detect a valid line and move the tokenizer
-			 * pointer if none remark field */
-			if (pos[0] != COMMENT_PREFIX) {
-				j = strlen(pos);
-				*(last - 1) = ',';	/* Plug the '0' with token parameter  */
-				last = last - (j + 1);
-
-				/* Now let's tokenize this valid line */
-				pos = strtok_r(NULL, ",=\n", &last);
+			/* Comment, to the end of the line */
+			if (pos < eol && *pos == '#') {
+				if (key.len > 0 && !parse_days(key, days, &first_day, &final_day))
+					config_error(line, key.ptr, line_start, "not KEYWORD=VALUE, skipped");
+				break;
 			}
-		}
 
-		if (!pos)
-			break;
+			if (pos == eol || *pos != '=') {
+				/* Lone day: macros that follow are for it */
+				if (key.len > 0 && !parse_days(key, days, &first_day, &final_day))
+					config_error(line, key.ptr, line_start, "not KEYWORD=VALUE, skipped");
+				pos++;
+				continue;
+			}
+			pos++;
 
-		if (pos[0] == COMMENT_PREFIX)
-			cmd = -1;
+			/* Days for the following ON/OFF macros */
+			if (parse_days(key, days, &first_day, &final_day))
+				continue;
 
-		/* Now parse the setting */
-		/* Excuse the goto coding, not nice but necessary here */
-		switch (cmd) {
-			/* Timer on/off? */
-		case TIMER:
-			if (strcasecmp(pos, "ON") == 0)
-				timer_flag = 1;
-			break;
+			int cmd;
+			for (cmd = 0; cmd < (int) NCOMMANDS; cmd++)
+				if (span_is(key, command[cmd]))
+					break;
 
-			/* Shutdown? */
-		case SHUTDOWN:
-			pTimer = pOff;
-			hour = minutes = -1;
-			goto process;
-
-			/* Macro OFF? */
-		case OFF:
-			pTimer = pOff;
-			hour = 24;
-			minutes = 0;
-			goto process;
-
-			/* Power-on? */
-		case POWERON:
-			pTimer = pOn;
-			hour = minutes = -1;
-			goto process;
-
-			/* Macro ON? */
-		case ON:
-			pTimer = pOn;
-			hour = minutes = 0;
-		process:
-			if (!sscanf(pos, "%02d:%02d", &hour, &minutes))
-				timer_flag = -1;
-
-			/* Ensure time entry is valid */
-			else if ((hour >= 0 && hour <= 24)
-				 && (minutes >= 0 && minutes <= 59)) {
-				/* Valid macro'd OFF/ON entry? */
-				if (cmd == OFF || cmd == ON) {
-					/* Group macro so create the other events */
-					if (group != 0) {
-						j = first_day - 1;
-						/* Create the multiple
-						 * entries for each day in
-						 * range specified */
-						while (j != process_day) {
-							j++;
-							if (j > 7)
-								j = 0;
-							pTimer->day = j;
-							pTimer->time = (hour * 60) + minutes;
-							pTimer->next = new event;
-							pTimer = pTimer->next;
-						}
-					} else {
-						pTimer->day = process_day;
-						pTimer->time = (hour * 60) + minutes;
-						pTimer->next = new event;
-						pTimer = pTimer->next;
-					}
-				}
+			/* A setting for someone else, such as DEVICE or EMMODE,
+			 * matches no case below: only its value is skipped */
+			span value = next_token(&pos, eol, ",#");
+			const char *what;
+			long minutes;
+
+			switch (cmd) {
+				/* Timer on/off? */
+			case TIMER:
+				if (span_is(value, "ON"))
+					c->timer_flag = 1;
+				break;
+
+				/* Shutdown, power-on and macro OFF/ON times */
+			case SHUTDOWN:
+			case POWERON:
+			case OFF:
+			case ON:
+				/* An empty time is allowed and means none */
+				if (value.len == 0)
+					break;
 
-				/* Now handle the defaults */
-				else if (cmd == SHUTDOWN)
-					off_time = (hour * 60) + minutes;
+				minutes = span_time(value);
+				if (minutes < 0) {
+					config_error(line, value.ptr, line_start, "invalid time, expected HH:MM");
+					timer_error = true;
+				} else if (cmd == SHUTDOWN)
+					c->off_time = minutes;
 				else if (cmd == POWERON)
-					on_time = (hour * 60) + minutes;
-			} else
-				timer_flag = -1;
+					c->on_time = minutes;
+				else if (first_day < 0) {
+					config_error(line, key.ptr, line_start, "ON/OFF without a day");
+					timer_error = true;
+				} else {
+					/* One event for each day in the range,
+					 * which may wrap around the week end */
+					for (int day = first_day; ; day = (day + 1) % 7) {
+						if (cmd == OFF)
+							week_add(&c->off_timer, day, minutes);
+						else
+							week_add(&c->on_timer, day, minutes);
+						if (day == final_day)
+							break;
+					}
+				}
+				break;
 
-			/* Update our pointers */
-			if (cmd < POWERON) // FIXME: Avoid ordered comparisons with enum
-				pOff = pTimer;
-			else
-				pOn = pTimer;
+				/* Disk check percentage? */
+			case DISKCHECK:
+				if (!span_int(value, &c->max_pct))
+					c->max_pct = -1;
+				ensure_limits(c->max_pct, -1, 100);
+				break;
 
-			break;
+				/* Refresh/re-scan time? */
+			case REFRESH:
+				if (!span_int(value, &c->refresh_rate))
+					c->refresh_rate = 40;
+				ensure_limits(c->refresh_rate, 10, FIVE_MINUTES);
+				break;
 
-			/* Disk check percentage? */
-		case DISKCHECK:
-			if (!sscanf(pos, "%5d", &max_pct))
-				max_pct = -1;
-			ensure_limits(max_pct, -1, 100);
-			break;
+				/* Button hold-in time? */
+			case HOLD:
+				if (!span_int(value, &c->hold_cycle))
+					c->hold_cycle = HOLD_SECONDS;
+				ensure_limits(c->hold_cycle, 2, 10);
+				break;
 
-			/* Refresh/re-scan time? */
-		case REFRESH:
-			if (!sscanf(pos, "%03d", &refresh_rate))
-				refresh_rate = 40;
-			ensure_limits(refresh_rate, 10, FIVE_MINUTES);
-			break;
+				/* Button press windows, in milliseconds */
+			case PRESSGAP:
+				if (!span_int(value, &c->press_gap))
+					c->press_gap = PRESS_GAP;
+				ensure_limits(c->press_gap, 100, 2000);
+				break;
 
-			/* Button hold-in time? */
-		case HOLD:
-			if (!sscanf(pos, "%02d", &hold_cycle))
-				hold_cycle = HOLD_SECONDS;
-			ensure_limits(hold_cycle, 2, 10);
-			break;
+			case CHORDGAP:
+				if (!span_int(value, &c->chord_gap))
+					c->chord_gap = CHORD_GAP;
+				ensure_limits(c->chord_gap, 20, 1000);
+				break;
 
-			/* Macro days in week? */
-		case SUN:
-		case MON:
-		case TUE:
-		case WED:
-		case THR:
-		case FRI:
-		case SAT:
-			/* For groups, */
-			process_day = cmd - SUN;
-			/* Remove grouping flag for next definition */
-			last_group += group;
-			if (last_group > 2) {
-				group = last_group = 0;
-			}
+			case DISKNAG:
+				if (span_is(value, "ON"))
+					c->pester_message = 1;
+				break;
 
-			if (last_group == 1)
-				first_day = process_day;
+				/* Early warning of a disk filling up, in minutes */
+			case FILLWARN:
+				if (span_is(value, "OFF"))
+					c->fill_warning = 0;
+				else {
+					if (!span_int(value, &c->fill_warning))
+						c->fill_warning = 60;
+					ensure_limits(c->fill_warning, 1, 24 * 60);
+				}
+				break;
 
-			break;
+				/* Fan failure stop time before event trigger */
+			case FANSTOP:
+				if (span_is(value, "OFF"))
+					c->fan_fault_seize = 0;
+				else {
+					if (!span_int(value, &c->fan_fault_seize))
+						c->fan_fault_seize = FAN_SEIZE_TIME;
+					ensure_limits(c->fan_fault_seize, 1, 60);
+				}
+				break;
 
-		case DISKNAG:
-			if (strcasecmp(pos, "ON") == 0)
-				pester_message = 1;
-			break;
-			/* Fan failure stop time before event trigger */
-		case FANSTOP:
-			if (strcasecmp(pos, "OFF") == 0)
-				fan_fault_seize = 0;
-			else {
-				if (!sscanf(pos, "%02d", &fan_fault_seize))
-					fan_fault_seize = FAN_SEIZE_TIME;
-				ensure_limits(fan_fault_seize, 1, 60);
+				/* Specified partition names */
+			case ROOT: /* root device */
+			case WORK: /* work device */
+			case DISK: /* any other, with its own thresholds */
+				what = add_monitor(c, value, cmd != DISK);
+				if (what) {
+					config_error(line, value.ptr, line_start, what);
+					valid = false;
+				}
+				break;
 			}
-			break;
 
-		/* Specified partition names */
-		case ROOT: /* root device */
-		case WORK: /* work device */
-			if (strlen(pos) <= 5) { // FIXME: make string length more flexible
-				diskcheck_number++;
-				char *tgt_device = (cmd == ROOT) ? root_device : work_device;
-				sprintf(tgt_device, "/dev/%s", pos);
-			}
-			break;
+			/* Next setting on the same line, unless a comment
+			 * follows */
+			if (pos < eol && *pos == '#')
+				break;
+			pos++;
 		}
+
+		line_start = eol + 1;
 	}
 
-	if (timer_flag < 0) {
-		timer_flag = 0;
+	week_compile(&c->off_timer);
+	week_compile(&c->on_timer);
+
+	if (timer_error)
 		report_error(3);
-	}
+
+	return valid && !timer_error;
+}
+
+
+/**
+ * Reset @a c to the defaults, dropping the macro events it had but
+ * keeping their storage for the next ones.
+ */
+static void config_defaults(config *c)
+{
+	c->off_timer.count = 0;
+	c->on_timer.count = 0;
+
+	c->timer_flag = 0;
+	c->off_time = c->on_time = -1;
+	c->max_pct = 90;
+	c->refresh_rate = 40;
+	c->hold_cycle = HOLD_SECONDS;
+	c->press_gap = PRESS_GAP;
+	c->chord_gap = CHORD_GAP;
+	c->pester_message = 0;
+	c->fill_warning = 60;
+	c->fan_fault_seize = FAN_SEIZE_TIME;
+	c->ndisks = 0;
 }
 
 
 /**
- * Destroys time objects
+ * Get next timed macro event.
  *
- * @param e A pointer to the event structure containing the head of the
- * linked list of events to be deleted.  Note that the entire linked list
- * is destroyed, not just its first element.
+ * @param time_now Minutes from midnight today to search from.
+ * @param week The macro events.
+ * @param time The next event after @a time_now, in minutes from midnight
+ * today, so possibly beyond 24 hours.
+ * @param defaultTime Time to use if there are no macro events, or if the
+ * next one is more than a day away.
  */
-static void destroy_timer(event *e)
+static void get_time(long time_now, const schedule *week, long *time, long defaultTime)
 {
-	event *aux;
+	if (week->count == 0) {
+		*time = defaultTime;
+		return;
+	}
+
+	long today = last_day * TWENTYFOURHR;
+	long now = today + time_now;
 
-	while (e) {
-		aux = e->next;
-		delete e;
-		e = aux;
+	/* First event strictly after now, by binary search */
+	int lo = 0, hi = week->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (week->when[mid] > now)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
+
+	/* Nothing left this week, take the first one of the next */
+	long next = lo < week->count ? week->when[lo] : week->when[0] + ONE_WEEK;
+	long offset = (next / TWENTYFOURHR) * TWENTYFOURHR - today;
+
+	*time = next - today;
+
+	if (offset > TWENTYFOURHR && defaultTime > 0)
+		*time = defaultTime;
+}
+
+
+/**
+ * UTC offset of the local zone at @a t, in seconds east.
+ */
+static long utc_offset(time_t t)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	return tm.tm_gmtoff;
+}
+
+
+/**
+ * Tell whether the local zone is no longer the one @a z was built for,
+ * either through TZ or through /etc/localtime.
+ */
+static bool zone_changed(const zone_table *z)
+{
+	struct stat st;
+	const char *tz = getenv("TZ");
+
+	if (strcmp(tz ? tz : "", z->tz) != 0)
+		return true;
+
+	if (stat(LOCALTIME_LOCATION, &st) != 0)
+		return z->ino != 0;
+
+	return st.st_ino != z->ino || st.st_mtime != z->mtime;
 }
 
 
 /**
- * Scan macro objects for a valid event from @a time today
+ * Build the table of UTC offsets of the local zone from a day before
+ * @a now, so that events being acted upon are covered, up to
+ * ZONE_HORIZON later.  Offsets are sampled hourly and each change is then
+ * narrowed down to the second.
  */
-static int find_next_today(long timeNow, event *cur, long *time)
+static void zone_build(zone_table *z, time_t now)
 {
-	int found = 0;
+	struct stat st;
+	const char *tz = getenv("TZ");
+
+	tzset();
+	snprintf(z->tz, sizeof(z->tz), "%s", tz ? tz : "");
+	z->ino = 0;
+	z->mtime = 0;
+	if (stat(LOCALTIME_LOCATION, &st) == 0) {
+		z->ino = st.st_ino;
+		z->mtime = st.st_mtime;
+	}
 
-	while (cur != NULL && !found) {
-		/* Next event for today?, at least 1 minute past current */
-		if (cur->day == last_day && cur->time > timeNow) {
-			found = 1;
-			*time = cur->time;
+	z->from = now - TWENTYFOURHR * 60;
+	z->until = z->from + ZONE_HORIZON;
+	z->count = 1;
+	z->start[0] = z->from;
+	z->offset[0] = utc_offset(z->from);
+
+	for (time_t t = z->from + 3600; t < z->until && z->count <= MAX_ZONE_CHANGES; t += 3600) {
+		long offset = utc_offset(t);
+
+		if (offset == z->offset[z->count - 1])
+			continue;
+
+		/* The change happened after lo and no later than t */
+		time_t lo = t - 3600, hi = t;
+		while (hi - lo > 1) {
+			time_t mid = lo + (hi - lo) / 2;
+			if (utc_offset(mid) == offset)
+				hi = mid;
+			else
+				lo = mid;
 		}
-		cur = cur->next;
+
+		z->start[z->count] = hi;
+		z->offset[z->count] = offset;
+		z->count++;
 	}
+}
+
+
+/**
+ * Convert @a t to local time, as seconds since the epoch on the local
+ * clock.
+ */
+static time_t zone_local(const zone_table *z, time_t t)
+{
+	if (t < z->from || t >= z->until)
+		return t + utc_offset(t);
+
+	int i = z->count - 1;
+	while (i > 0 && t < z->start[i])
+		i--;
 
-	return found;
+	return t + z->offset[i];
 }
 
 
 /**
- * Find one next event in the linked list beginning with @a cur with day
- * strictly greater than @a last_day.
- *
- * @param cur Initial cell of a linked list of events.
- * @param time The time of the next event found, if any.
- * @param offset The difference in minutes between @a last_day and the day of
- * the event found by the function, if any.
- *
- * @return 1 if an event was found and 0 otherwise.
+ * Convert a local time back to absolute time.  A local time given twice
+ * when the clocks go back is taken the first time round; one skipped
+ * when they go forward is moved on by the change, as mktime() does.
  */
-static int find_next_day(event *cur, long *time, long *offset)
+static time_t zone_utc(const zone_table *z, time_t local)
 {
-	int found = 0;
+	for (int i = 0; i < z->count; i++) {
+		time_t t = local - z->offset[i];
+		time_t end = i + 1 < z->count ? z->start[i + 1] : z->until;
 
-	while (cur != NULL && !found) {
-		if (cur->day > last_day) {
-			*offset = (cur->day - last_day) * TWENTYFOURHR;
-			*time = cur->time;
-			found = 1;
-		}
-		cur = cur->next;
+		/* In the gap before this segment */
+		if (t < z->start[i])
+			return i > 0 ? local - z->offset[i - 1] : t;
+
+		if (t < end)
+			return t;
 	}
 
-	return found;
+	return local - utc_offset(local);
 }
 
 
 /**
- * Get next timed macro event.
+ * Work out the first event of @a week, or the daily @a default_time,
+ * strictly after @a after.
+ *
+ * @return The instant of the event, or 0 if there is none.
  */
-static void get_time(long time_now, event *pTimerLocate, long *time, long defaultTime)
+static time_t next_event(const schedule *week, long default_time, time_t after)
 {
-	/* Ensure that macro timer object is valid */
-	if (pTimerLocate && pTimerLocate->next != NULL) {
-		long offset = 0;
-		event *pTimer = pTimerLocate;
-		/* Next event for today */
-		char located = find_next_today(time_now, pTimer, time);
+	time_t local = zone_local(&zone, after);
+	time_t midnight = local - local % (TWENTYFOURHR * 60);
+	long minute = (local % (TWENTYFOURHR * 60)) / 60;
+	long time;
 
-		/* Failed to find a time for today, look for the next
-		 * power-up time */
-		if (!located) {
-			pTimer = pTimerLocate;
-			located = find_next_day(pTimer, time, &offset);
-		}
+	/* 1st January 1970 was a Thursday */
+	last_day = (local / (TWENTYFOURHR * 60) + 4) % 7;
 
-		/* Nothing for week-end, look at start */
-		if (!located) {
-			*time = pTimerLocate->time;
-			offset = ((6 - last_day) + pTimerLocate->day) * TWENTYFOURHR;
-		}
+	get_time(minute, week, &time, default_time);
+	if (time < 0)
+		return 0;
 
-		*time += offset;
+	/* Daily times already gone by are for tomorrow */
+	if (time <= minute)
+		time += TWENTYFOURHR;
 
-		if (offset > TWENTYFOURHR && defaultTime > 0)
-			*time = defaultTime;
-	} else
-		*time = defaultTime;
+	time_t at = zone_utc(&zone, midnight + time * 60);
+	return at > after ? at : 0;
+}
+
+
+/**
+ * Format @a t as local MM/DD HH:MM into @a buff.
+ */
+static void format_local(char *buff, size_t size, time_t t)
+{
+	struct tm tm;
+	time_t local = zone_local(&zone, t);
+
+	gmtime_r(&local, &tm);
+	snprintf(buff, size, "%02d/%02d %02d:%02d",
+		 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min);
 }
 
 
 /**
  * Determine shutdown/power up time and fire relevant string update to
- * the AVR.
+ * the AVR.  The next shutdown and power-on are worked out in absolute
+ * time, so that a change of daylight saving time in between is allowed
+ * for, and are only worked out again when the configuration, the clock
+ * or the time zone changes.
  */
 static void set_avr_timer(int type)
 {
-	time_t ltime, ttime;
-	struct tm *decode_time;
-	char message[80];
+	time_t now = time(NULL);
+	char off_msg[32], on_msg[32];
 	long mask = 0x800;
-	long offTime, onTime;
-
-	/* Timer enabled? */
-	if (timer_flag) {
-		/* Get time of day */
-		time(&ltime);
-
-		decode_time = localtime(&ltime);
-		long current_time = (decode_time->tm_hour * 60) + decode_time->tm_min;
-		last_day = decode_time->tm_wday;
-
-		get_time(current_time, off_timer, &offTime, off_time);
-		/* Correct search if switch-off is tomorrow */
-		if (offTime > TWENTYFOURHR)
-			get_time(current_time, on_timer, &onTime, on_time);
-		else
-			get_time(offTime, on_timer, &onTime, on_time);
-
-		/* Protect for tomorrow's setting */
-		shutdown_timer = (offTime < current_time) ?
-			(TWELVEHR + (offTime - (current_time - TWELVEHR))) * 60 :
-			(offTime - current_time) * 60;
+	uart_frame frame;
 
-		/* Remember the current seconds passed the minute. */
-		shutdown_timer -= decode_time->tm_sec;
+	frame_reset(&frame);
 
-		ttime = ltime + shutdown_timer;
-		decode_time = localtime(&ttime);
+	/* Keep the zone table current, its contents only change with the
+	 * zone itself */
+	bool rebuilt = false;
+	if (zone.until == 0 || now < zone.from || now + ZONE_HORIZON / 2 > zone.until ||
+	    zone_changed(&zone)) {
+		zone_build(&zone, now);
+		rebuilt = true;
+	}
 
-		sprintf(message, "Timer is set with %02d/%02d %02d:%02d",
-			decode_time->tm_mon + 1, decode_time->tm_mday,
-			decode_time->tm_hour, decode_time->tm_min);
+	/* A re-validation reuses the plan while it still holds */
+	if (type != 1 || rebuilt || plan.off_at <= now) {
+		plan.off_at = next_event(&cfg->off_timer, cfg->off_time, now);
+		plan.on_at = plan.off_at ? next_event(&cfg->on_timer, cfg->on_time, plan.off_at) : 0;
+	}
 
-		/* Now, setup the AVR with the power-on time */
+	const static char *msg_kind[] = { "file update", "re-validation", "clock skew" };
 
-		long wait_time;
+	/* Timer enabled? */
+	if (cfg->timer_flag && plan.off_at) {
+		shutdown_timer = plan.off_at - now;
+		last_shutdown_mono = mono_now();
+		format_local(off_msg, sizeof(off_msg), plan.off_at);
+	}
 
-		/* Correct to AVR oscillator */
-		if (onTime < current_time) {
-			wait_time = (TWELVEHR + (onTime - (current_time - TWELVEHR))) * 60;
-			onTime = ((TWELVEHR + (onTime - (current_time - TWELVEHR))) * 100) / 112;
-		} else {
-			if (onTime < (offTime - TWENTYFOURHR))
-				onTime += TWENTYFOURHR;
-			else if (onTime < offTime)
-				onTime += TWENTYFOURHR;
+	long wake = WAKE_OFF;
+	time_t wake_at = 0;
 
-			wait_time = (onTime - current_time) * 60;
-			onTime = ((onTime - current_time) * 100) / 112;
-		}
+	if (cfg->timer_flag && plan.off_at && plan.on_at) {
+		/* Now, setup the AVR with the power-on time, in units of
+		 * its oscillator */
+		long wait_time = plan.on_at - now;
+		long onTime = (wait_time / 60 * 100) / 112;
 
 		/* Limit max off time to next power-on to the resolution of the timer */
 		if (onTime > TIMER_RESOLUTION
@@ -1220,44 +4889,64 @@ static void set_avr_timer(int type)
 			onTime = TIMER_RESOLUTION;
 		}
 
-		ttime = ltime + wait_time;
-		decode_time = localtime(&ttime);
+		wake = onTime;
+		wake_at = now + wait_time;
+		format_local(on_msg, sizeof(on_msg), wake_at);
 
-		const static char *msg_kind[] = { "file update", "re-validation", "clock skew" };
+		syslog(LOG_INFO, "Timer is set with %s-%s (Following timer %s)",
+		       off_msg, on_msg, msg_kind[type]);
+	} else if (cfg->timer_flag && plan.off_at)
+		syslog(LOG_INFO, "Timer is set with %s, without a power-on time (Following timer %s)",
+		       off_msg, msg_kind[type]);
+	else if (cfg->timer_flag)
+		syslog(LOG_INFO, "Timer is on but no shutdown time is set");
 
-		syslog(LOG_INFO, "%s-%02d/%02d %02d:%02d (Following timer %s)",
-		       message, decode_time->tm_mon + 1, decode_time->tm_mday,
-		       decode_time->tm_hour, decode_time->tm_min, msg_kind[type]);
-
-		/* Now tell the AVR we are updating the 'on' time */
-		write_to_uart(0x3E);	/* '>' */
-		write_to_uart(0x3C);	/* '<' */
-		write_to_uart(0x3A);	/* ':' */
-		write_to_uart(0x38);	/* '8' */
+	/* Only tell the AVR about an 'on' time it does not hold already.
+	 * Its countdown is judged by the power-on it stands for, as the
+	 * same countdown taken later would be short of it. */
+	if (wake >= 0 && (panel.wake < 0 || panel.wake_at != wake_at)) {
+		frame_cmd<CMD_TIMER_BEGIN>(&frame);
 
 		/* Bit pattern (12-bits) detailing time to wake */
 		for (int i = 0; i < 12; i++) {
-			char avr_cmd = (onTime & mask ? 0x21 : 0x20) + ((11 - i) * 2);
+			int bit = (wake & mask) ? 1 : 0;
 			mask >>= 1;
 
 			/* Output to AVR */
-			write_to_uart(avr_cmd);
+			frame_cmd<CMD_WAKE_BIT>(&frame, (11 - i) * 2 + bit);
 		}
 
-		/* Complete output and set LED state (power) to pulse */
-		write_to_uart(0x3F);	/* '?' */
-		keep_alive = 0x5B;	/* '[' */
-	} else {		/* Inform AVR its not in timer mode */
-		write_to_uart(0x3E);	/* '>' */
-		keep_alive = 0x5A;	/* 'Z' */
+		frame_cmd<CMD_TIMER_END>(&frame);
+	} else if (wake == WAKE_OFF && panel.wake != WAKE_OFF) {
+		/* Inform AVR there is nothing to wake up for */
+		frame_cmd<CMD_TIMER_OFF>(&frame);
 	}
 
-	write_to_uart(keep_alive);
+	/* Power LED pulses while a timed shutdown is set */
+	panel.keep_alive = cfg->timer_flag && plan.off_at ? CMD_PULSE : CMD_STEADY;
+
+	/* Send the whole transaction in one go, ending on the keep-alive.
+	 * The shadow only takes it in once the AVR has it. */
+	if (frame.length > 0 || panel.power_led != panel.keep_alive) {
+		frame_cmd(&frame, panel.keep_alive);
+		if (frame_flush(&frame) == 0) {
+			panel.wake = wake;
+			panel.wake_at = wake_at;
+			panel.power_led = panel.keep_alive;
+			panel.kicked = mono_now();
+		} else
+			panel_forget();
+	} else
+		panel.skipped++;
+
+	schedule_shutdown();
 }
 
 
 /**
- * Check to see if the configuration file has changed since the last time we checked.
+ * Read the configuration file again and reprogram the AVR timer.  This
+ * is run when the file changes, on SIGHUP and on a large clock drift.  A
+ * file with errors leaves the current configuration in place.
  *
  * @param type The value to be passed to avr_set_timer: with 0 when the
  * config file has to be read, 1 when the status has to be re-validated, and
@@ -1266,42 +4955,62 @@ static void set_avr_timer(int type)
  */
 static void check_timer(int type)
 {
-	char buff[4096];
 	struct stat filestatus;
+	char *buff = NULL;
+	size_t used = 0;
 
-	/* Time from avr-evtd configuration file */
-	if (command_line_update == 1) {
-		/* File is missing so default to off and do not do this again */
-		command_line_update = 2;
+	/* Time from avr-evtd configuration file, read in full.  It is not
+	 * mmap()ed as it may be truncated by an editor under our feet. */
+	int file = open(config_file, O_RDONLY | O_CLOEXEC);
 
-		if (stat(CONFIG_FILE_LOCATION, &filestatus) == 0) {
-			if (filestatus.st_mtime != last_config_mtime) {
-				int file = open(CONFIG_FILE_LOCATION, O_RDONLY);
+	if (file >= 0 && fstat(file, &filestatus) == 0) {
+		size_t size = filestatus.st_size + 1;
+		ssize_t res;
 
-				if (file) {
-					if (read(file, buff, sizeof(buff) - 1) > 0) {
-						command_line_update = 1;
-						parse_config(buff);
-						set_avr_timer(type);
-					}
-					close(file);
-				}
-			} else
-				command_line_update = 1;
+		buff = (char *) malloc(size);
+		while (buff && (res = read(file, buff + used, size - used)) > 0) {
+			used += res;
 
-			last_config_mtime = filestatus.st_mtime;
-		} else {
-			/* The file could not be stat'ed */
+			/* Grown since fstat(), make room */
+			if (used == size) {
+				char *bigger = (char *) realloc(buff, size * 2);
+				if (!bigger)
+					break;
+				buff = bigger;
+				size *= 2;
+			}
 		}
 	}
 
-	/* Ensure that if we have any configuration errors we at least set timer off. */
-	if (command_line_update == 2) {
-		command_line_update = 3;
+	if (file >= 0)
+		close(file);
+
+	/* A timed shutdown that did not happen is over now */
+	shutdown_run(SD_REARM);
+
+	if (used > 0) {
+		/* Read into the spare snapshot and only switch over to it
+		 * once it has been found valid */
+		config *next = cfg == &configs[0] ? &configs[1] : &configs[0];
+
+		if (parse_config(buff, used, next)) {
+			const config *old = cfg;
+			next->generation = old->generation + 1;
+			cfg = next;
+			sync_monitors(old);
+		} else
+			syslog(LOG_ERR, "errors in %s, keeping the previous configuration",
+			       config_file);
+
+		free(buff);
+		set_avr_timer(type);
+	} else {
+		free(buff);
+		/* Ensure that if we have any configuration errors we at
+		 * least set timer off. */
 		set_avr_timer(type);
 		report_error(1);
 	}
-
 }
 
 
@@ -1347,6 +5056,45 @@ int main(int argc, char *argv[])
 		case 'e':
 			in_em_mode = 1;
 			break;
+		case 's':
+			--argc;
+			++argv;
+			if (argc <= 0) {
+				printf("Option -s requires an argument.\n\n");
+				usage();
+			}
+
+			event_script = *argv;
+			break;
+		case 'f':
+			--argc;
+			++argv;
+			if (argc <= 0) {
+				printf("Option -f requires an argument.\n\n");
+				usage();
+			}
+
+			if (set_config_file(*argv) < 0) {
+				fprintf(stderr, "Configuration file name too long.\n");
+				exit(1);
+			}
+			break;
+		case 'p':
+			persistent_handler = true;
+			break;
+		case 'a':
+			--argc;
+			++argv;
+			if (argc <= 0) {
+				printf("Option -a requires an argument.\n\n");
+				usage();
+			}
+
+			if (add_action(*argv) < 0) {
+				fprintf(stderr, "Invalid action: %s.\n", *argv);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage();
 		default:
@@ -1357,6 +5105,9 @@ int main(int argc, char *argv[])
 		++argv;
 	}
 
+	sched_init(&timers);
+	config_defaults(&configs[0]);
+
 	if (!debug) {
 		if (daemon(0, 0) != 0)	/* fork to background */
 			exit(-1);
@@ -1365,13 +5116,16 @@ int main(int argc, char *argv[])
 
 	/* ignore tty signals */
 	signal(SIGTSTP, SIG_IGN);
-	signal(SIGHUP, SIG_IGN);
-	signal(SIGCHLD, SIG_IGN);
 
-	/* Set up termination handlers */
-	signal(SIGTERM, termination_handler);
-	signal(SIGCONT, termination_handler);
-	signal(SIGINT, termination_handler);
+	/* A persistent event handler may go away under our feet */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Termination, hang-up and child exits are picked up by the main
+	 * loop through a signalfd, so keep them from being delivered
+	 * asynchronously. */
+	sigset_t mask;
+	loop_signals(&mask);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
 
 	/* Specified port? */
 	if (open_serial(avr_device, probe_only))
@@ -0,0 +1,229 @@
+/*
+ * @file fsm.cpp
+ *
+ * Runs the button, fan and timed shutdown state machines of avr-evtd
+ * through their transitions, without a serial port
+ *
+ * Copyright © 2008-2015 Rogério Theodoro de Brito <rbrito@ime.usp.br>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ */
+
+/* The tables are static, so the daemon is built in with its main() aside */
+#define main avr_evtd_real_main
+#include "../avr-evtd.cpp"
+#undef main
+
+static const char *const button_states[] = { "IDLE", "DOWN", "UP", "HELD", "SPENT" };
+static const char *const button_events[] = {
+	"PUSH", "RELEASE", "HOLD_OVER", "LONG_OVER", "GAP_OVER", "CHORD", "INTERRUPT"
+};
+static const char *const button_actions[] = {
+	"NONE", "START", "COUNT", "FLUSH", "HOLD", "LONG_HOLD", "CHORD"
+};
+
+static const char *const fan_states[] = { "OK", "SLOWING", "STOPPED", "FAILED", "HIGH" };
+static const char *const fan_events[] = { "HIGH", "FAULT", "TIMER" };
+static const char *const fan_actions[] = { "NONE", "RECHECK", "REPORT", "GIVE_UP", "SLOW_DOWN" };
+
+static const char *const shutdown_states[] = { "ARMED", "WARNED", "PAUSED", "DOWN" };
+static const char *const shutdown_events[] = {
+	"DUE", "WARN_DUE", "TIME_UP", "PRESS", "PAUSE_OVER", "REARM"
+};
+static const char *const shutdown_actions[] = {
+	"NONE", "PASS", "RESCHEDULE", "WARN", "EXTEND", "RESUME", "SHUTDOWN", "CANCEL"
+};
+
+/*
+ * Each row is fed from its own state: what the machine is expected to do
+ * with the event, and where it is expected to end up.  Rows marked
+ * illegal are events that make no sense in that state and are expected
+ * to be ignored.
+ */
+static const button_transition button_cases[] = {
+	/* A press, counted once the gap is over */
+	{ BTN_IDLE,	BTN_PUSH,	BTN_DOWN,	BA_START },
+	{ BTN_DOWN,	BTN_RELEASE,	BTN_UP,		BA_COUNT },
+	{ BTN_UP,	BTN_PUSH,	BTN_DOWN,	BA_START },
+	{ BTN_UP,	BTN_GAP_OVER,	BTN_IDLE,	BA_FLUSH },
+	/* Holds */
+	{ BTN_DOWN,	BTN_HOLD_OVER,	BTN_HELD,	BA_HOLD },
+	{ BTN_DOWN,	BTN_LONG_OVER,	BTN_SPENT,	BA_LONG_HOLD },
+	{ BTN_HELD,	BTN_LONG_OVER,	BTN_SPENT,	BA_LONG_HOLD },
+	{ BTN_HELD,	BTN_RELEASE,	BTN_IDLE,	BA_NONE },
+	{ BTN_SPENT,	BTN_RELEASE,	BTN_IDLE,	BA_NONE },
+	/* The other button */
+	{ BTN_DOWN,	BTN_CHORD,	BTN_SPENT,	BA_CHORD },
+	{ BTN_DOWN,	BTN_INTERRUPT,	BTN_DOWN,	BA_FLUSH },
+	{ BTN_UP,	BTN_INTERRUPT,	BTN_IDLE,	BA_FLUSH },
+	/* Illegal: a release without a push, timers of a press long gone */
+	{ BTN_IDLE,	BTN_RELEASE,	BTN_IDLE,	BA_NONE },
+	{ BTN_IDLE,	BTN_HOLD_OVER,	BTN_IDLE,	BA_NONE },
+	{ BTN_IDLE,	BTN_LONG_OVER,	BTN_IDLE,	BA_NONE },
+	{ BTN_IDLE,	BTN_GAP_OVER,	BTN_IDLE,	BA_NONE },
+	{ BTN_IDLE,	BTN_CHORD,	BTN_IDLE,	BA_NONE },
+	{ BTN_DOWN,	BTN_PUSH,	BTN_DOWN,	BA_NONE },
+	{ BTN_DOWN,	BTN_GAP_OVER,	BTN_DOWN,	BA_NONE },
+	{ BTN_UP,	BTN_RELEASE,	BTN_UP,		BA_NONE },
+	{ BTN_UP,	BTN_HOLD_OVER,	BTN_UP,		BA_NONE },
+	{ BTN_UP,	BTN_LONG_OVER,	BTN_UP,		BA_NONE },
+	{ BTN_HELD,	BTN_PUSH,	BTN_HELD,	BA_NONE },
+	{ BTN_HELD,	BTN_HOLD_OVER,	BTN_HELD,	BA_NONE },
+	{ BTN_HELD,	BTN_CHORD,	BTN_HELD,	BA_NONE },
+	{ BTN_SPENT,	BTN_PUSH,	BTN_SPENT,	BA_NONE },
+	{ BTN_SPENT,	BTN_LONG_OVER,	BTN_SPENT,	BA_NONE },
+	{ BTN_SPENT,	BTN_CHORD,	BTN_SPENT,	BA_NONE },
+	{ BTN_SPENT,	BTN_INTERRUPT,	BTN_SPENT,	BA_NONE },
+};
+
+static const fan_transition fan_cases[] = {
+	{ FAN_OK,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+	{ FAN_HIGH,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+	{ FAN_HIGH,	FAN_EV_TIMER,	FAN_SLOWING,	FA_SLOW_DOWN },
+	{ FAN_SLOWING,	FAN_EV_TIMER,	FAN_OK,		FA_NONE },
+	{ FAN_SLOWING,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+	/* Every failure is reported, and given up on after FANSTOP */
+	{ FAN_OK,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+	{ FAN_HIGH,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+	{ FAN_STOPPED,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+	{ FAN_STOPPED,	FAN_EV_TIMER,	FAN_FAILED,	FA_GIVE_UP },
+	{ FAN_FAILED,	FAN_EV_FAULT,	FAN_STOPPED,	FA_REPORT },
+	/* Started again */
+	{ FAN_STOPPED,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+	{ FAN_FAILED,	FAN_EV_HIGH,	FAN_HIGH,	FA_RECHECK },
+	/* Illegal: JOB_FAN due with nothing to do */
+	{ FAN_OK,	FAN_EV_TIMER,	FAN_OK,		FA_NONE },
+	{ FAN_FAILED,	FAN_EV_TIMER,	FAN_FAILED,	FA_NONE },
+};
+
+static const shutdown_transition shutdown_cases[] = {
+	/* Counting down to the warning, then to the shutdown */
+	{ SD_ARMED,	SD_DUE,		SD_ARMED,	SA_RESCHEDULE },
+	{ SD_ARMED,	SD_WARN_DUE,	SD_WARNED,	SA_WARN },
+	{ SD_WARNED,	SD_DUE,		SD_WARNED,	SA_RESCHEDULE },
+	{ SD_WARNED,	SD_WARN_DUE,	SD_WARNED,	SA_RESCHEDULE },
+	{ SD_ARMED,	SD_TIME_UP,	SD_DOWN,	SA_SHUTDOWN },
+	{ SD_WARNED,	SD_TIME_UP,	SD_DOWN,	SA_SHUTDOWN },
+	/* Put off by the user */
+	{ SD_ARMED,	SD_PRESS,	SD_ARMED,	SA_PASS },
+	{ SD_WARNED,	SD_PRESS,	SD_PAUSED,	SA_EXTEND },
+	{ SD_PAUSED,	SD_PRESS,	SD_PAUSED,	SA_EXTEND },
+	{ SD_PAUSED,	SD_PAUSE_OVER,	SD_ARMED,	SA_RESUME },
+	/* Jobs held off during the pause */
+	{ SD_PAUSED,	SD_DUE,		SD_PAUSED,	SA_NONE },
+	{ SD_PAUSED,	SD_WARN_DUE,	SD_PAUSED,	SA_NONE },
+	{ SD_PAUSED,	SD_TIME_UP,	SD_PAUSED,	SA_NONE },
+	/* Latched once down: only a press or a new shutdown time leave it */
+	{ SD_DOWN,	SD_DUE,		SD_DOWN,	SA_NONE },
+	{ SD_DOWN,	SD_WARN_DUE,	SD_DOWN,	SA_NONE },
+	{ SD_DOWN,	SD_TIME_UP,	SD_DOWN,	SA_NONE },
+	{ SD_DOWN,	SD_PAUSE_OVER,	SD_DOWN,	SA_NONE },
+	{ SD_DOWN,	SD_PRESS,	SD_ARMED,	SA_CANCEL },
+	{ SD_DOWN,	SD_REARM,	SD_ARMED,	SA_NONE },
+	/* Illegal: a pause that never began, a rearm mid countdown */
+	{ SD_ARMED,	SD_PAUSE_OVER,	SD_ARMED,	SA_NONE },
+	{ SD_WARNED,	SD_PAUSE_OVER,	SD_WARNED,	SA_NONE },
+	{ SD_ARMED,	SD_REARM,	SD_ARMED,	SA_NONE },
+	{ SD_WARNED,	SD_REARM,	SD_WARNED,	SA_NONE },
+	{ SD_PAUSED,	SD_REARM,	SD_PAUSED,	SA_NONE },
+};
+
+/* A timed shutdown from the warning, put off twice, then cancelled */
+static const shutdown_transition shutdown_sequence[] = {
+	{ SD_ARMED,	SD_DUE,		SD_ARMED,	SA_RESCHEDULE },
+	{ SD_ARMED,	SD_WARN_DUE,	SD_WARNED,	SA_WARN },
+	{ SD_WARNED,	SD_PRESS,	SD_PAUSED,	SA_EXTEND },
+	{ SD_PAUSED,	SD_PRESS,	SD_PAUSED,	SA_EXTEND },
+	{ SD_PAUSED,	SD_TIME_UP,	SD_PAUSED,	SA_NONE },
+	{ SD_PAUSED,	SD_PAUSE_OVER,	SD_ARMED,	SA_RESUME },
+	{ SD_ARMED,	SD_TIME_UP,	SD_DOWN,	SA_SHUTDOWN },
+	{ SD_DOWN,	SD_TIME_UP,	SD_DOWN,	SA_NONE },
+	{ SD_DOWN,	SD_PRESS,	SD_ARMED,	SA_CANCEL },
+	{ SD_ARMED,	SD_PRESS,	SD_ARMED,	SA_PASS },
+};
+
+static int failures;
+
+
+/**
+ * Feed every row of @a cases to @a table from the state of the row.
+ */
+template <typename S, typename E, typename A, size_t NS, size_t NE, size_t NC>
+static void check_steps(const char *machine, const transition<S, E, A> (&table)[NS][NE],
+			const transition<S, E, A> (&cases)[NC], const char *const states[],
+			const char *const events[], const char *const actions[])
+{
+	for (size_t i = 0; i < NC; i++) {
+		const transition<S, E, A> &c = cases[i];
+		S state = c.state;
+		A action = fsm_step(table, &state, c.event);
+
+		if (state != c.next || action != c.action) {
+			printf("%s: %s on %s: got %s, %s; expected %s, %s\n", machine,
+			       states[c.state], events[c.event], states[state], actions[action],
+			       states[c.next], actions[c.action]);
+			failures++;
+		}
+	}
+}
+
+
+/**
+ * Feed the rows of @a run to @a table one after the other, from the
+ * state of the first.
+ */
+template <typename S, typename E, typename A, size_t NS, size_t NE, size_t NC>
+static void check_run(const char *machine, const transition<S, E, A> (&table)[NS][NE],
+		      const transition<S, E, A> (&run)[NC], const char *const states[],
+		      const char *const events[], const char *const actions[])
+{
+	S state = run[0].state;
+
+	for (size_t i = 0; i < NC; i++) {
+		const transition<S, E, A> &c = run[i];
+		S from = state;
+		A action = fsm_step(table, &state, c.event);
+
+		if (from != c.state || state != c.next || action != c.action) {
+			printf("%s: step %zu, %s on %s: got %s, %s; expected %s on %s: %s, %s\n",
+			       machine, i + 1, states[from], events[c.event], states[state],
+			       actions[action], states[c.state], events[c.event], states[c.next],
+			       actions[c.action]);
+			failures++;
+			return;
+		}
+	}
+}
+
+
+int main(void)
+{
+	check_steps("button", button_table, button_cases, button_states, button_events,
+		    button_actions);
+	check_steps("fan", fan_table, fan_cases, fan_states, fan_events, fan_actions);
+	check_steps("shutdown", shutdown_table, shutdown_cases, shutdown_states,
+		    shutdown_events, shutdown_actions);
+	check_run("shutdown", shutdown_table, shutdown_sequence, shutdown_states, shutdown_events,
+		  shutdown_actions);
+
+	if (failures) {
+		printf("fsm: %d transitions failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
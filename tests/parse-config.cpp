@@ -0,0 +1,253 @@
+/*
+ * @file parse-config.cpp
+ *
+ * Harness for the configuration parser of avr-evtd: prints what a file
+ * parses to, times the parser, or, built with -DFUZZING, serves as a
+ * libFuzzer target
+ *
+ * Copyright © 2008-2015 Rogério Theodoro de Brito <rbrito@ime.usp.br>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ */
+
+/* The parser is static, so the daemon is built in with its main() aside */
+#define main avr_evtd_real_main
+#include "../avr-evtd.cpp"
+#undef main
+
+#include <stdint.h>
+
+static int errors_reported;	/* ERRORED events raised by the parser */
+
+
+/**
+ * Count the errors the parser reports to the event script, instead of
+ * running it.
+ */
+static int count_error(const avr_evtd_event *ev, const char *param)
+{
+	(void) ev;
+	(void) param;
+
+	errors_reported++;
+	return 0;
+}
+
+
+static const avr_evtd_plugin error_counter = { AVR_EVTD_PLUGIN_ABI, "count", count_error };
+
+
+/**
+ * Set up the daemon state the parser relies on.
+ */
+static void harness_init(void)
+{
+	actions[0].event = ERRORED;
+	actions[0].plugin = &error_counter;
+	actions[0].param = NULL;
+	nactions = 1;
+}
+
+
+#ifdef FUZZING
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static bool ready;
+
+	if (!ready) {
+		harness_init();
+		setlogmask(LOG_MASK(LOG_EMERG));
+		ready = true;
+	}
+
+	parse_config((const char *) data, size, &configs[1]);
+	return 0;
+}
+
+#else
+
+/**
+ * Read the whole of @a path.
+ *
+ * @return A malloc'd buffer, or NULL on error.
+ */
+static char *read_file(const char *path, size_t *length)
+{
+	FILE *file = fopen(path, "r");
+	char *content = NULL;
+	size_t size = 0;
+
+	*length = 0;
+	if (!file)
+		return NULL;
+
+	for (;;) {
+		if (*length == size) {
+			char *bigger = (char *) realloc(content, size + 4096);
+			if (!bigger)
+				break;
+			content = bigger;
+			size += 4096;
+		}
+
+		size_t n = fread(content + *length, 1, size - *length, file);
+		if (n == 0)
+			break;
+		*length += n;
+	}
+
+	fclose(file);
+	return content;
+}
+
+
+/**
+ * Print a time of day given in minutes, or "none".
+ */
+static void print_time(const char *name, long minutes)
+{
+	if (minutes < 0)
+		printf("%s none\n", name);
+	else
+		printf("%s %02ld:%02ld\n", name, minutes / 60, minutes % 60);
+}
+
+
+/**
+ * Print the macro events of @a week, one day and time each.
+ */
+static void print_week(const char *name, const schedule *week)
+{
+	const char *const days[] = { "SUN", "MON", "TUE", "WED", "THR", "FRI", "SAT" };
+
+	printf("%s %d", name, week->count);
+	for (int i = 0; i < week->count; i++) {
+		long minutes = week->when[i] % TWENTYFOURHR;
+		printf(" %s-%02ld:%02ld", days[week->when[i] / TWENTYFOURHR],
+		       minutes / 60, minutes % 60);
+	}
+	printf("\n");
+}
+
+
+/**
+ * Print every setting of @a c, so that a change in how a file parses
+ * shows up in a diff.
+ */
+static void print_config(const config *c, bool valid)
+{
+	printf("valid %s\n", valid ? "yes" : "no");
+	printf("errors %d\n", errors_reported);
+	printf("timer %d\n", c->timer_flag);
+	print_time("shutdown", c->off_time);
+	print_time("poweron", c->on_time);
+	print_week("off", &c->off_timer);
+	print_week("on", &c->on_timer);
+	printf("diskcheck %d\n", c->max_pct);
+	printf("refresh %d\n", c->refresh_rate);
+	printf("hold %d\n", c->hold_cycle);
+	printf("pressgap %d\n", c->press_gap);
+	printf("chordgap %d\n", c->chord_gap);
+	printf("disknag %d\n", c->pester_message);
+	printf("fillwarn %d\n", c->fill_warning);
+	printf("fanstop %d\n", c->fan_fault_seize);
+
+	for (int i = 0; i < c->ndisks; i++) {
+		const fs_spec *fs = &c->disks[i];
+		printf("disk %s %d %d %d\n", fs->name, fs->block_pct,
+		       fs->inode_pct, fs->hysteresis);
+	}
+}
+
+
+static void print_usage(void)
+{
+	printf("usage: parse-config [-b COUNT] FILE...\n\n"
+	       "Print the settings each FILE parses to, with the parser errors\n"
+	       "on stderr, or with -b time COUNT parses of each FILE.\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	long rounds = 0;
+	int status = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			rounds = atol(optarg);
+			break;
+		default:
+			print_usage();
+			return 2;
+		}
+	}
+
+	if (optind == argc) {
+		print_usage();
+		return 2;
+	}
+
+	harness_init();
+
+	/* Parser errors on stderr, and not in the system log when timing */
+	openlog("parse-config", LOG_PERROR, LOG_USER);
+	if (rounds > 0)
+		setlogmask(LOG_MASK(LOG_EMERG));
+
+	for (int i = optind; i < argc; i++) {
+		size_t length;
+		char *content = read_file(argv[i], &length);
+
+		if (!content) {
+			fprintf(stderr, "parse-config: cannot read %s: %s\n", argv[i], strerror(errno));
+			status = 1;
+			continue;
+		}
+
+		/* Errors are logged against the name as given */
+		snprintf(config_file, sizeof(config_file), "%s", argv[i]);
+		errors_reported = 0;
+
+		if (rounds > 0) {
+			usec_t start = mono_usec();
+
+			for (long n = 0; n < rounds; n++)
+				parse_config(content, length, &configs[1]);
+
+			double elapsed = mono_usec() - start;
+			printf("%-32s %8zu bytes %10.2f us/parse %8.1f MB/s\n", argv[i], length,
+			       elapsed / rounds, length * rounds / elapsed);
+		} else {
+			printf("== %s\n", argv[i]);
+			fflush(stdout);
+
+			bool valid = parse_config(content, length, &configs[1]);
+			print_config(&configs[1], valid);
+			fflush(stdout);
+		}
+
+		free(content);
+	}
+
+	return status;
+}
+
+#endif